@@ -7,14 +7,23 @@
 #include <Protocol/LoadedImage.h>
 #include <Protocol/SimpleFileSystem.h>
 #include <Protocol/GraphicsOutput.h>
+#include <Pi/PiMultiPhase.h>
+#include <Protocol/MpService.h>
+#include <Guid/Acpi.h>
+#include <Guid/FileInfo.h>
 
 
 /* Use GUID names 'gEfi...' that are already declared in Protocol headers. */
 EFI_GUID gEfiLoadedImageProtocolGuid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
 EFI_GUID gEfiSimpleFileSystemProtocolGuid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
 EFI_GUID gEfiGraphicsOutputProtocolGuid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
+EFI_GUID gEfiAcpi20TableGuid = EFI_ACPI_20_TABLE_GUID;
+EFI_GUID gEfiAcpi10TableGuid = ACPI_10_TABLE_GUID;
+EFI_GUID gEfiFileInfoGuid = EFI_FILE_INFO_ID;
+EFI_GUID gEfiMpServiceProtocolGuid = EFI_MP_SERVICES_PROTOCOL_GUID;
 
 typedef unsigned int uint32_t;
+typedef unsigned long long uint64_t;
 
 /* Keep these variables global. */
 static EFI_HANDLE ImageHandle;
@@ -27,6 +36,131 @@ typedef struct framebuffer_s {
 	uint32_t height;
 } framebuffer_t;
 
+/*
+ * The loader-to-kernel handoff; must match p2/kernel/include/boot_info.h.
+ * Only fixed-size fields: 'long' is 32-bit here but 64-bit in the kernel.
+ * New fields go to the end and bump BOOT_INFO_VERSION.
+ */
+#define BOOT_INFO_MAGIC		0x4F464E49544F4F42ULL /* "BOOTINFO" */
+#define BOOT_INFO_VERSION	3
+
+#define BOOT_MODULES_MAX	8
+#define BOOT_MODULE_NAME_MAX	16
+#define BOOT_MARKS_MAX		16
+#define BOOT_MARK_NAME_MAX	24
+
+typedef struct boot_module_s {
+	uint64_t base;		/* physical address of the loaded image */
+	uint64_t size;		/* bytes */
+	uint64_t entry;		/* physical entry point, 0 if none */
+	char name[BOOT_MODULE_NAME_MAX];
+} boot_module_t;
+
+typedef struct boot_mark_s {
+	uint64_t tsc;		/* when the phase ended */
+	char name[BOOT_MARK_NAME_MAX];
+} boot_mark_t;
+
+typedef struct boot_info_s {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t size;		/* sizeof(boot_info_t) in the loader */
+
+	/* The final UEFI memory map (after ExitBootServices) */
+	uint64_t memory_map;	/* EFI_MEMORY_DESCRIPTOR array */
+	uint64_t memory_map_size;
+	uint64_t memory_desc_size;
+	uint32_t memory_desc_version;
+	uint32_t reserved0;
+
+	/* GOP framebuffer */
+	uint64_t fb_base;
+	uint64_t fb_size;
+	uint32_t fb_width;
+	uint32_t fb_height;
+	uint32_t fb_stride;	/* pixels per scan line */
+	uint32_t fb_format;	/* EFI_GRAPHICS_PIXEL_FORMAT */
+
+	uint64_t rsdp;		/* ACPI RSDP, 0 if not found */
+
+	/* Early kernel memory: the heap followed by the first frame-allocator zone */
+	uint64_t memory;
+	uint64_t memory_size;
+
+	uint32_t module_count;
+	uint32_t reserved1;
+	boot_module_t modules[BOOT_MODULES_MAX];
+
+	/* Boot timeline (version 2) */
+	uint64_t tsc_khz;	/* TSC ticks per millisecond */
+	uint32_t mark_count;
+	uint32_t map_retries;	/* extra GetMemoryMap/ExitBootServices rounds */
+	boot_mark_t marks[BOOT_MARKS_MAX];
+
+	/*
+	 * Kernel page tables built by the loader (version 3), cr3 is 0 unless
+	 * the loader is built with BOOT_PT=1: an identity map in PML4[0],
+	 * aliased at 0xFFFF800000000000, large pages above the first 2 MiB
+	 */
+	uint64_t cr3;
+	uint64_t page_tables_size;	/* bytes */
+	uint64_t identity_map_size;	/* bytes, a multiple of 1 GiB */
+} boot_info_t;
+
+/* The parts of the ELF64 format that the loader needs */
+#define ELF_MAGIC	0x464C457FU /* "\x7FELF" */
+#define ELFCLASS64	2
+#define EM_X86_64	62
+#define PT_LOAD		1
+#define ELF_PHDRS_MAX	16
+
+typedef struct {
+	UINT8  e_ident[16];
+	UINT16 e_type;
+	UINT16 e_machine;
+	UINT32 e_version;
+	UINT64 e_entry;
+	UINT64 e_phoff;
+	UINT64 e_shoff;
+	UINT32 e_flags;
+	UINT16 e_ehsize;
+	UINT16 e_phentsize;
+	UINT16 e_phnum;
+	UINT16 e_shentsize;
+	UINT16 e_shnum;
+	UINT16 e_shstrndx;
+} Elf64_Ehdr;
+
+typedef struct {
+	UINT32 p_type;
+	UINT32 p_flags;
+	UINT64 p_offset;
+	UINT64 p_vaddr;
+	UINT64 p_paddr;
+	UINT64 p_filesz;
+	UINT64 p_memsz;
+	UINT64 p_align;
+} Elf64_Phdr;
+
+/*
+ * Images packed by imgpack/imgpack.c: the header, a table of compressed
+ * block sizes, then LZ4 blocks that decompress to consecutive block_size
+ * pieces of the in-memory image.
+ */
+#define IMGPACK_MAGIC	0x4B504D49U	/* "IMPK" */
+#define IMGPACK_STORED	0x80000000U	/* the block is not compressed */
+#define IMGPACK_BLOCKS_MAX	4096
+
+typedef struct {
+	UINT32 magic;
+	UINT32 block_size;
+	UINT32 block_count;
+	UINT32 reserved;
+	UINT64 entry;		/* entry point, relative to the image start */
+	UINT64 raw_size;	/* bytes that the blocks decompress to */
+	UINT64 mem_size;	/* bytes the image occupies in memory */
+} imgpack_header_t;
+
 // Currently uses only EfiBootServicesData
 // The function can be extended to accept any type as necessary
 static VOID *AllocatePool(UINTN size)
@@ -46,60 +180,96 @@ static VOID FreePages(EFI_PHYSICAL_ADDRESS buf, UINTN pages)
 {
 	BootServices->FreePages(buf, pages);
 }
-static EFI_STATUS OpenKernel(EFI_FILE_PROTOCOL **pvh, EFI_FILE_PROTOCOL **pfh)
+/* Files are read in chunks of this size, aligned to file offsets */
+#define READ_CHUNK	SIZE_2MB
+
+static UINT64 TscKhz;		/* TSC ticks per millisecond */
+
+static inline UINT64 ReadTsc(void)
 {
-	EFI_LOADED_IMAGE *li = NULL;
-	EFI_FILE_IO_INTERFACE *fio = NULL;
-	EFI_FILE_PROTOCOL *vh;
- 	EFI_STATUS efi_status;
+	return __builtin_ia32_rdtsc();
+}
 
-	*pvh = NULL;
-	*pfh = NULL;
+static VOID CalibrateTsc(void)
+{
+	UINT64 start = ReadTsc();
+	BootServices->Stall(10000); // 10 ms
+	TscKhz = (ReadTsc() - start) / 10;
+	if (TscKhz == 0)
+		TscKhz = 1;
+}
 
-	efi_status = BootServices->HandleProtocol(ImageHandle,
-					&gEfiLoadedImageProtocolGuid, (void **) &li);
-	if (EFI_ERROR(efi_status)) {
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-			L"Cannot get LoadedImage for BOOTx64.EFI\r\n");
-		return efi_status;
-	}
+// Records the end of a boot phase for the kernel's timeline
+static VOID Mark(boot_info_t *bi, const char *name)
+{
+	boot_mark_t *mark;
+	UINTN i;
 
-	efi_status = BootServices->HandleProtocol(li->DeviceHandle,
-					&gEfiSimpleFileSystemProtocolGuid, (void **) &fio);
-	if (EFI_ERROR(efi_status)) {
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-						L"Cannot get fio\r\n");
-		return efi_status;
-	}
+	if (bi->mark_count == BOOT_MARKS_MAX)
+		return;
+	mark = &bi->marks[bi->mark_count++];
+	mark->tsc = ReadTsc();
+	for (i = 0; i < BOOT_MARK_NAME_MAX - 1 && name[i] != '\0'; i++)
+		mark->name[i] = name[i];
+	mark->name[i] = '\0';
+}
 
-	efi_status = fio->OpenVolume(fio, pvh);
-	if (EFI_ERROR(efi_status)) {
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-						L"Cannot get the volume handle!\r\n");
-		return efi_status;
-	}
-	vh = *pvh;
+static UINT64 TscToUs(UINT64 ticks)
+{
+	return ticks * 1000 / TscKhz;
+}
 
-	efi_status = vh->Open(vh, pfh, L"\\EFI\\BOOT\\KERNEL",
-					EFI_FILE_MODE_READ, 0);
-	if (EFI_ERROR(efi_status)) {
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-						L"Cannot get the file handle!\r\n");
-		return efi_status;
-	}
+static VOID PrintDec(UINT64 num)
+{
+	CHAR16 buf[21];
+	UINTN i = 20;
 
-	return EFI_SUCCESS;
+	buf[i] = L'\0';
+	do {
+		buf[--i] = L'0' + (CHAR16) (num % 10);
+		num /= 10;
+	} while (num != 0);
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, &buf[i]);
+}
+
+static VOID PrintAscii(const char *str)
+{
+	CHAR16 buf[32];
+	UINTN i;
+
+	for (i = 0; i < 31 && str[i] != '\0'; i++)
+		buf[i] = (CHAR16) str[i];
+	buf[i] = L'\0';
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, buf);
 }
 
-static EFI_STATUS OpenUser(EFI_FILE_PROTOCOL **pvh, EFI_FILE_PROTOCOL **pfh)
+static EFI_STATUS GetFileSize(EFI_FILE_PROTOCOL *fh, UINT64 *size)
+{
+	EFI_FILE_INFO *info = NULL;
+	UINTN infoSize = 0;
+	EFI_STATUS efi_status;
+
+	efi_status = fh->GetInfo(fh, &gEfiFileInfoGuid, &infoSize, NULL);
+	if (efi_status != EFI_BUFFER_TOO_SMALL)
+		return EFI_ERROR(efi_status) ? efi_status : EFI_DEVICE_ERROR;
+	info = AllocatePool(infoSize);
+	if (info == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	efi_status = fh->GetInfo(fh, &gEfiFileInfoGuid, &infoSize, info);
+	if (!EFI_ERROR(efi_status))
+		*size = info->FileSize;
+	FreePool(info);
+	return efi_status;
+}
+
+// Opens the volume that BOOTx64.EFI was loaded from
+static EFI_STATUS OpenVolume(EFI_FILE_PROTOCOL **pvh)
 {
 	EFI_LOADED_IMAGE *li = NULL;
 	EFI_FILE_IO_INTERFACE *fio = NULL;
-	EFI_FILE_PROTOCOL *vh;
  	EFI_STATUS efi_status;
 
 	*pvh = NULL;
-	*pfh = NULL;
 
 	efi_status = BootServices->HandleProtocol(ImageHandle,
 					&gEfiLoadedImageProtocolGuid, (void **) &li);
@@ -123,32 +293,10 @@ static EFI_STATUS OpenUser(EFI_FILE_PROTOCOL **pvh, EFI_FILE_PROTOCOL **pfh)
 						L"Cannot get the volume handle!\r\n");
 		return efi_status;
 	}
-	vh = *pvh;
-
-	efi_status = vh->Open(vh, pfh, L"\\EFI\\BOOT\\USER",
-					EFI_FILE_MODE_READ, 0);
-	if (EFI_ERROR(efi_status)) {
-		SystemTable->ConOut->OutputString(SystemTable->ConOut,
-						L"Cannot get the user file handle!\r\n");
-		return efi_status;
-	}
-
 	return EFI_SUCCESS;
 }
 
-static void CloseKernel(EFI_FILE_PROTOCOL *vh, EFI_FILE_PROTOCOL *fh)
-{
-	vh->Close(vh);
-	fh->Close(fh);
-}
-
-static void CloseUser(EFI_FILE_PROTOCOL *vh, EFI_FILE_PROTOCOL *fh)
-{
-	vh->Close(vh);
-	fh->Close(fh);
-}
-
-static UINT32 *SetGraphicsMode(UINT32 width, UINT32 height)
+static UINT32 *SetGraphicsMode(UINT32 width, UINT32 height, boot_info_t *bi)
 {
 	EFI_GRAPHICS_OUTPUT_PROTOCOL *graphics;
 	EFI_STATUS efi_status;
@@ -196,6 +344,14 @@ static UINT32 *SetGraphicsMode(UINT32 width, UINT32 height)
                                                   L"Failed to set graphics mode!\r\n");
                 return NULL;
             }
+
+            // Describe the frame buffer for the kernel
+            bi->fb_base = graphics->Mode->FrameBufferBase;
+            bi->fb_size = graphics->Mode->FrameBufferSize;
+            bi->fb_width = width;
+            bi->fb_height = height;
+            bi->fb_stride = graphics->Mode->Info->PixelsPerScanLine;
+            bi->fb_format = graphics->Mode->Info->PixelFormat;
 				// Return the frame buffer base address
 			return (UINT32 *) graphics->Mode->FrameBufferBase;
 		}
@@ -204,103 +360,1058 @@ static UINT32 *SetGraphicsMode(UINT32 width, UINT32 height)
 	return NULL;
 }
 
-/* Use System V ABI rather than EFI/Microsoft ABI. */
-typedef void (*kernel_entry_t) (void *, void *, unsigned int *, int, int, void *, void *, unsigned long) __attribute__((sysv_abi));
-EFI_STATUS EFIAPI
-efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable)
+static BOOLEAN GuidEqual(const EFI_GUID *a, const EFI_GUID *b)
 {
-	///////////////////////
-	// Part 1: 
-	EFI_FILE_PROTOCOL *vh, *fh;
+	const UINT8 *pa = (const UINT8 *) a, *pb = (const UINT8 *) b;
+	UINTN i;
+
+	for (i = 0; i < sizeof(EFI_GUID); i++) {
+		if (pa[i] != pb[i])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+// Returns the ACPI 2.0+ RSDP, or the ACPI 1.0 one if that is all there is
+static uint64_t FindRsdp(void)
+{
+	uint64_t rsdp = 0;
+	UINTN i;
+
+	for (i = 0; i < SystemTable->NumberOfTableEntries; i++) {
+		EFI_CONFIGURATION_TABLE *table = &SystemTable->ConfigurationTable[i];
+
+		if (GuidEqual(&table->VendorGuid, &gEfiAcpi20TableGuid))
+			return (uint64_t) table->VendorTable;
+		if (GuidEqual(&table->VendorGuid, &gEfiAcpi10TableGuid))
+			rsdp = (uint64_t) table->VendorTable;
+	}
+	return rsdp;
+}
+
+static VOID AddModule(boot_info_t *bi, const char *name, uint64_t base,
+		      uint64_t size, uint64_t entry)
+{
+	boot_module_t *module;
+	UINTN i;
+
+	if (bi->module_count == BOOT_MODULES_MAX)
+		return;
+	module = &bi->modules[bi->module_count++];
+	module->base = base;
+	module->size = size;
+	module->entry = entry;
+	for (i = 0; i < BOOT_MODULE_NAME_MAX - 1 && name[i] != '\0'; i++)
+		module->name[i] = name[i];
+	module->name[i] = '\0';
+}
+
+static VOID FreeModules(boot_info_t *bi)
+{
+	UINT32 i;
+	for (i = 0; i < bi->module_count; i++)
+		FreePages(bi->modules[i].base, EFI_SIZE_TO_PAGES(bi->modules[i].size));
+	bi->module_count = 0;
+}
+
+/*
+ * Parallel jobs: large work is split into items that the BSP and all
+ * enabled APs (EFI_MP_SERVICES_PROTOCOL) take from a shared counter. Item
+ * functions run on APs, so they must not use boot services. Without the
+ * protocol, or with a single processor, jobs run serially. The LZ4 unpack
+ * is the only job of a normal boot; zeroing the kernel memory is a
+ * BOOT_MP_BENCH job, and there is no checksum job.
+ */
+#define PAR_CHUNK	SIZE_2MB	/* bytes per zero/copy item (BOOT_MP_BENCH) */
+
+typedef struct {
+	VOID (*run)(VOID *arg, UINTN item);
+	VOID *arg;
+	UINTN items;
+	UINTN next;			/* the next item to take */
+	UINTN failed;			/* set by items that fail */
+} par_job_t;
+
+static EFI_MP_SERVICES_PROTOCOL *MpServices;
+static UINTN NumCpus = 1;
+
+static VOID InitMp(void)
+{
+	UINTN total, enabled;
+
+	if (EFI_ERROR(BootServices->LocateProtocol(&gEfiMpServiceProtocolGuid, NULL,
+						    (VOID **) &MpServices)) ||
+	    EFI_ERROR(MpServices->GetNumberOfProcessors(MpServices, &total, &enabled)) ||
+	    enabled < 2) {
+		MpServices = NULL;
+		NumCpus = 1;
+		return;
+	}
+	NumCpus = enabled;
+}
+
+static VOID EFIAPI ParWorker(VOID *arg)
+{
+	par_job_t *job = arg;
+	UINTN item;
+
+	while ((item = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->items)
+		job->run(job->arg, item);
+}
+
+// All processors at once: the APs start in non-blocking mode and the BSP
+// works along with them until the event says they are done
+static VOID RunJob(par_job_t *job)
+{
+	EFI_EVENT done;
+	UINTN index;
+
+	job->next = 0;
+	if (MpServices != NULL && job->items > 1 &&
+	    !EFI_ERROR(BootServices->CreateEvent(0, 0, NULL, NULL, &done))) {
+		if (!EFI_ERROR(MpServices->StartupAllAPs(MpServices, ParWorker, FALSE,
+							 done, 0, job, NULL))) {
+			ParWorker(job);
+			BootServices->WaitForEvent(1, &done, &index);
+			BootServices->CloseEvent(done);
+			return;
+		}
+		BootServices->CloseEvent(done);
+	}
+	ParWorker(job);
+}
+
+#ifdef BOOT_MP_BENCH
+// "<what>: <us> us serial, <us> us on <n> CPUs (<speedup>x)"
+static VOID ReportSpeedup(const CHAR16 *what, UINT64 serial, UINT64 parallel)
+{
+	UINT64 ratio = parallel ? serial * 100 / parallel : 0;
+
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, (CHAR16 *) what);
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, L": ");
+	PrintDec(TscToUs(serial));
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, L" us serial, ");
+	PrintDec(TscToUs(parallel));
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, L" us on ");
+	PrintDec(NumCpus);
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, L" CPUs (");
+	PrintDec(ratio / 100);
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, ratio % 100 < 10 ? L".0" : L".");
+	PrintDec(ratio % 100);
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, L"x)\r\n");
+}
+#endif
+
+// Runs a job on all processors. With BOOT_MP_BENCH=1 the (idempotent) job
+// also runs on the BSP alone first, and both times are reported.
+static VOID RunParallel(par_job_t *job, const CHAR16 *what)
+{
+#ifdef BOOT_MP_BENCH
+	UINT64 start = ReadTsc(), serial;
+
+	job->next = 0;
+	ParWorker(job);
+	serial = ReadTsc() - start;
+	start = ReadTsc();
+	RunJob(job);
+	ReportSpeedup(what, serial, ReadTsc() - start);
+#else
+	(VOID) what;
+	RunJob(job);
+#endif
+}
+
+static inline VOID ZeroBytes(VOID *dst, UINTN size)
+{
+	UINTN qwords = size / 8, rest = size % 8;
+
+	__asm__ __volatile__ ("rep stosq" : "+D" (dst), "+c" (qwords) : "a" (0ULL) : "memory");
+	__asm__ __volatile__ ("rep stosb" : "+D" (dst), "+c" (rest) : "a" (0ULL) : "memory");
+}
+
+static inline VOID CopyBytes(VOID *dst, const VOID *src, UINTN size)
+{
+	__asm__ __volatile__ ("rep movsb" : "+D" (dst), "+S" (src), "+c" (size) : : "memory");
+}
+
+#ifdef BOOT_MP_BENCH
+typedef struct {
+	UINT8 *dst;
+	const UINT8 *src;	/* NULL: zero */
+	UINT64 size;
+} range_job_t;
+
+static VOID RangeItem(VOID *arg, UINTN item)
+{
+	range_job_t *range = arg;
+	UINT64 off = (UINT64) item * PAR_CHUNK;
+	UINT64 len = range->size - off < PAR_CHUNK ? range->size - off : PAR_CHUNK;
+
+	if (range->src != NULL)
+		CopyBytes(range->dst + off, range->src + off, len);
+	else
+		ZeroBytes(range->dst + off, len);
+}
+
+static VOID ParallelZero(VOID *dst, UINT64 size, const CHAR16 *what)
+{
+	range_job_t range = { dst, NULL, size };
+	par_job_t job = { RangeItem, &range, (size + PAR_CHUNK - 1) / PAR_CHUNK, 0, 0 };
+
+	RunParallel(&job, what);
+}
+#endif
+
+/*
+ * A module being loaded. Headers are read right away; the bulk of the file
+ * is queued (see QueueRead()) and the module is finished once all queued
+ * reads are done, so the reads of all modules can overlap.
+ */
+typedef struct {
+	char name[BOOT_MODULE_NAME_MAX];
+	EFI_FILE_PROTOCOL *fh;
+	UINT64 fileSize;
+	UINT64 bytesRead;
+	EFI_PHYSICAL_ADDRESS base;	/* the final allocation */
+	UINTN numPages;
+	UINT64 entry;			/* relative to base */
+
+	/* imgpack images: the compressed blocks go to a scratch buffer */
+	imgpack_header_t pack;
+	UINT32 *blockSizes;
+	EFI_PHYSICAL_ADDRESS scratch;
+	UINTN scratchPages;
+	UINT64 unpackTicks;
+	UINTN unpackFailed;		/* set by UnpackItem() */
+} load_ctx_t;
+
+// Reads exactly 'size' bytes at 'offset', in READ_CHUNK-aligned pieces
+static EFI_STATUS ReadAt(load_ctx_t *ctx, UINT64 offset, VOID *buf, UINT64 size)
+{
+	EFI_FILE_PROTOCOL *fh = ctx->fh;
 	EFI_STATUS efi_status;
-	UINT32 *fb;
-	
-	ImageHandle = imageHandle;
-	SystemTable = systemTable;
-	BootServices = systemTable->BootServices;
+	UINT8 *dst = buf;
+
+	efi_status = fh->SetPosition(fh, offset);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	while (size != 0) {
+		UINTN numToRead = READ_CHUNK - (offset % READ_CHUNK);
+		UINTN chunk;
+
+		if (numToRead > size)
+			numToRead = size;
+		chunk = numToRead;
+		efi_status = fh->Read(fh, &numToRead, dst);
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+		ctx->bytesRead += numToRead;
+		if (numToRead != chunk)
+			return EFI_END_OF_FILE;
+		dst += chunk;
+		offset += chunk;
+		size -= chunk;
+	}
+	return EFI_SUCCESS;
+}
+
+/*
+ * Queued reads: EFI_FILE_PROTOCOL revision 2 ReadEx() with an event token
+ * returns as soon as the request is queued; the FAT driver completes it
+ * through DiskIo2/BlockIo2 when the disk supports non-blocking I/O. Without
+ * ReadEx() (or if it fails to queue) the read is done synchronously.
+ */
+#define READS_MAX	64
+
+typedef struct {
+	EFI_FILE_IO_TOKEN token;
+	UINTN size;
+	load_ctx_t *ctx;
+} pending_read_t;
+
+static pending_read_t Reads[READS_MAX];
+static UINTN NumReads;
+static BOOLEAN AsyncReads = TRUE;	/* cleared once ReadEx() is unavailable */
+static UINTN QueuedReads;		/* completed asynchronously, for the report */
+
+// Waits for all queued reads; the first failure is returned
+static EFI_STATUS WaitReads(void)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+	UINTN i, index;
+
+	for (i = 0; i < NumReads; i++) {
+		pending_read_t *rd = &Reads[i];
+		EFI_STATUS efi_status;
+
+		efi_status = BootServices->WaitForEvent(1, &rd->token.Event, &index);
+		if (!EFI_ERROR(efi_status))
+			efi_status = rd->token.Status;
+		if (!EFI_ERROR(efi_status) && rd->token.BufferSize != rd->size)
+			efi_status = EFI_END_OF_FILE;
+		if (!EFI_ERROR(efi_status))
+			rd->ctx->bytesRead += rd->size;
+		else if (!EFI_ERROR(ret))
+			ret = efi_status;
+		BootServices->CloseEvent(rd->token.Event);
+	}
+	NumReads = 0;
+	return ret;
+}
+
+static EFI_STATUS QueueRead(load_ctx_t *ctx, UINT64 offset, VOID *buf, UINT64 size)
+{
+	EFI_FILE_PROTOCOL *fh = ctx->fh;
+	EFI_STATUS efi_status;
+	UINT8 *dst = buf;
+
+	if (!AsyncReads || fh->Revision < EFI_FILE_PROTOCOL_REVISION2)
+		return ReadAt(ctx, offset, buf, size);
+
+	while (size != 0) {
+		UINTN chunk = READ_CHUNK - (offset % READ_CHUNK);
+		pending_read_t *rd;
+
+		if (chunk > size)
+			chunk = size;
+		if (NumReads == READS_MAX) {
+			efi_status = WaitReads();
+			if (EFI_ERROR(efi_status))
+				return efi_status;
+		}
+		rd = &Reads[NumReads];
+		efi_status = BootServices->CreateEvent(0, 0, NULL, NULL, &rd->token.Event);
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+		rd->token.Status = EFI_SUCCESS;
+		rd->token.BufferSize = chunk;
+		rd->token.Buffer = dst;
+		rd->size = chunk;
+		rd->ctx = ctx;
+
+		// The position is consumed when the request is queued
+		efi_status = fh->SetPosition(fh, offset);
+		if (!EFI_ERROR(efi_status))
+			efi_status = fh->ReadEx(fh, &rd->token);
+		if (EFI_ERROR(efi_status)) {
+			BootServices->CloseEvent(rd->token.Event);
+			if (efi_status != EFI_UNSUPPORTED)
+				return efi_status;
+			AsyncReads = FALSE;
+			return ReadAt(ctx, offset, dst, size);
+		}
+		NumReads++;
+		QueuedReads++;
+		dst += chunk;
+		offset += chunk;
+		size -= chunk;
+	}
+	return EFI_SUCCESS;
+}
 
-	efi_status = OpenKernel(&vh, &fh);
+// A flat binary, entered at its first byte
+static EFI_STATUS PrepareFlat(load_ctx_t *ctx)
+{
+	EFI_STATUS efi_status;
 
+	if (ctx->fileSize == 0)
+		return EFI_LOAD_ERROR;
+	ctx->numPages = EFI_SIZE_TO_PAGES(ctx->fileSize);
+	efi_status = BootServices->AllocatePages(AllocateAnyPages, EfiBootServicesData,
+						 ctx->numPages, &ctx->base);
 	if (EFI_ERROR(efi_status)) {
-		BootServices->Stall(5 * 1000000); // 5 seconds
+		ctx->numPages = 0;
 		return efi_status;
 	}
+	ctx->entry = 0;
+	return QueueRead(ctx, 0, (VOID *) ctx->base, ctx->fileSize);
+}
+
+// Loads the PT_LOAD segments of a position-independent ELF64 image. The
+// segments keep their relative placement (the code is %rip-relative), so
+// one allocation spans them; only file-backed bytes are read, .bss is zeroed.
+static EFI_STATUS PrepareElf(load_ctx_t *ctx)
+{
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr phdrs[ELF_PHDRS_MAX];
+	UINT64 lo = ~0ULL, hi = 0;
+	UINTN i;
+	EFI_STATUS efi_status;
 
-	// Load the kernel
-    // Seek to the beginning of the file
-    efi_status = fh->SetPosition(fh, 0);
-    if (EFI_ERROR(efi_status)) {
-        SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to load kernal!\r\n");
+	efi_status = ReadAt(ctx, 0, &ehdr, sizeof(ehdr));
+	if (EFI_ERROR(efi_status))
 		return efi_status;
-    }
 
-	//Allocate kernal buffer 
-	void *kernelBuffer = AllocatePool(SIZE_1MB);
-	if (kernelBuffer == NULL) {
-		SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to allocate kernal buffer!\r\n");
-        return RETURN_OUT_OF_RESOURCES;
-    }
+	if (ehdr.e_ident[4] != ELFCLASS64 || ehdr.e_machine != EM_X86_64 ||
+	    ehdr.e_phentsize != sizeof(Elf64_Phdr) || ehdr.e_phnum == 0 ||
+	    ehdr.e_phnum > ELF_PHDRS_MAX)
+		return EFI_UNSUPPORTED;
+
+	efi_status = ReadAt(ctx, ehdr.e_phoff, phdrs, ehdr.e_phnum * sizeof(Elf64_Phdr));
+	if (EFI_ERROR(efi_status))
+		return efi_status;
 
-    // Read the file content into the buffer
-	UINTN numToRead = SIZE_1MB;
+	for (i = 0; i < ehdr.e_phnum; i++) {
+		if (phdrs[i].p_type != PT_LOAD || phdrs[i].p_memsz == 0)
+			continue;
+		if (phdrs[i].p_filesz > phdrs[i].p_memsz ||
+		    phdrs[i].p_offset + phdrs[i].p_filesz > ctx->fileSize)
+			return EFI_UNSUPPORTED;
+		if (phdrs[i].p_vaddr < lo)
+			lo = phdrs[i].p_vaddr;
+		if (phdrs[i].p_vaddr + phdrs[i].p_memsz > hi)
+			hi = phdrs[i].p_vaddr + phdrs[i].p_memsz;
+	}
+	if (hi == 0)
+		return EFI_UNSUPPORTED;
+	lo &= ~(UINT64) (EFI_PAGE_SIZE - 1);
 
-	efi_status = fh->Read(fh, &numToRead, kernelBuffer);
+	ctx->numPages = EFI_SIZE_TO_PAGES(hi - lo);
+	efi_status = BootServices->AllocatePages(AllocateAnyPages, EfiBootServicesData,
+						 ctx->numPages, &ctx->base);
 	if (EFI_ERROR(efi_status)) {
-		SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to read kernal!\r\n");
+		ctx->numPages = 0;
 		return efi_status;
 	}
+	ctx->entry = ehdr.e_entry - lo;
 
-	CloseKernel(vh, fh);
+	for (i = 0; i < ehdr.e_phnum; i++) {
+		UINT8 *dst = (UINT8 *) (ctx->base + (phdrs[i].p_vaddr - lo));
 
-	fb = SetGraphicsMode(800, 600);
-	if (fb == NULL) {
-		// Handle error
-		FreePool(kernelBuffer);
-		return RETURN_UNSUPPORTED;
+		if (phdrs[i].p_type != PT_LOAD || phdrs[i].p_memsz == 0)
+			continue;
+		if (phdrs[i].p_filesz != 0) {
+			efi_status = QueueRead(ctx, phdrs[i].p_offset, dst, phdrs[i].p_filesz);
+			if (EFI_ERROR(efi_status))
+				return efi_status;
+		}
+		BootServices->SetMem(dst + phdrs[i].p_filesz,
+				     phdrs[i].p_memsz - phdrs[i].p_filesz, 0);
 	}
+	return EFI_SUCCESS;
+}
 
-	kernel_entry_t func = (kernel_entry_t) kernelBuffer;
+// Decodes one LZ4 block; FALSE unless it fills 'dst' exactly. No boot
+// services here, so that the same code can run on any processor.
+static BOOLEAN Lz4Decompress(const UINT8 *src, UINTN srcSize, UINT8 *dst, UINTN dstSize)
+{
+	const UINT8 *ip = src, *iend = src + srcSize;
+	UINT8 *op = dst, *oend = dst + dstSize;
 
-	/////////////////////////////////////
-	//Part 3:
-	
-	EFI_FILE_PROTOCOL *u_vh, *u_fh;
+	while (ip < iend) {
+		UINTN token = *ip++;
+		UINTN len = token >> 4;
+		UINTN offset;
+		const UINT8 *match;
 
-	efi_status = OpenUser(&u_vh, &u_fh);
+		if (len == 15) {
+			UINT8 b;
+			do {
+				if (ip == iend)
+					return FALSE;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		if (len > (UINTN) (iend - ip) || len > (UINTN) (oend - op))
+			return FALSE;
+		while (len >= 8) {
+			__builtin_memcpy(op, ip, 8);
+			op += 8;
+			ip += 8;
+			len -= 8;
+		}
+		while (len-- != 0)
+			*op++ = *ip++;
+		if (ip == iend) // the last sequence has no match
+			break;
+
+		if (iend - ip < 2)
+			return FALSE;
+		offset = ip[0] | ((UINTN) ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (UINTN) (op - dst))
+			return FALSE;
+		len = token & 15;
+		if (len == 15) {
+			UINT8 b;
+			do {
+				if (ip == iend)
+					return FALSE;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		len += 4;
+		if (len > (UINTN) (oend - op))
+			return FALSE;
+		match = op - offset;
+		if (offset >= 8) {
+			while (len >= 8) {
+				__builtin_memcpy(op, match, 8);
+				op += 8;
+				match += 8;
+				len -= 8;
+			}
+		}
+		while (len-- != 0) // overlapping matches repeat the pattern
+			*op++ = *match++;
+	}
+	return op == oend;
+}
+
+// An imgpack image: the compressed blocks are read into a scratch buffer
+// and decompressed straight into the final allocation by FinishPacked()
+static EFI_STATUS PreparePacked(load_ctx_t *ctx)
+{
+	imgpack_header_t *hdr = &ctx->pack;
+	UINT64 table, packed;
+	EFI_STATUS efi_status;
+
+	efi_status = ReadAt(ctx, 0, hdr, sizeof(*hdr));
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+	table = (UINT64) hdr->block_count * sizeof(UINT32);
+	if (hdr->block_size == 0 || hdr->block_count == 0 ||
+	    hdr->block_count > IMGPACK_BLOCKS_MAX || hdr->raw_size > hdr->mem_size ||
+	    hdr->raw_size > (UINT64) hdr->block_size * hdr->block_count ||
+	    hdr->entry >= hdr->mem_size || sizeof(*hdr) + table > ctx->fileSize)
+		return EFI_UNSUPPORTED;
+	packed = ctx->fileSize - sizeof(*hdr) - table;
+
+	ctx->blockSizes = AllocatePool(table);
+	if (ctx->blockSizes == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	efi_status = ReadAt(ctx, sizeof(*hdr), ctx->blockSizes, table);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	ctx->scratchPages = EFI_SIZE_TO_PAGES(packed);
+	efi_status = BootServices->AllocatePages(AllocateAnyPages, EfiBootServicesData,
+						 ctx->scratchPages, &ctx->scratch);
 	if (EFI_ERROR(efi_status)) {
-		BootServices->Stall(5 * 1000000); // 5 seconds
+		ctx->scratchPages = 0;
+		return efi_status;
+	}
+	ctx->numPages = EFI_SIZE_TO_PAGES(hdr->mem_size);
+	efi_status = BootServices->AllocatePages(AllocateAnyPages, EfiBootServicesData,
+						 ctx->numPages, &ctx->base);
+	if (EFI_ERROR(efi_status)) {
+		ctx->numPages = 0;
+		return efi_status;
+	}
+	ctx->entry = hdr->entry;
+	return QueueRead(ctx, sizeof(*hdr) + table, (VOID *) ctx->scratch, packed);
+}
+
+typedef struct {
+	load_ctx_t *ctx;
+	UINT64 *offsets;	/* of each block in the scratch buffer */
+} unpack_job_t;
+
+static VOID UnpackItem(VOID *arg, UINTN item)
+{
+	unpack_job_t *unpack = arg;
+	load_ctx_t *ctx = unpack->ctx;
+	imgpack_header_t *hdr = &ctx->pack;
+	UINT64 dst = (UINT64) item * hdr->block_size;
+	UINT64 len = hdr->raw_size - dst < hdr->block_size ? hdr->raw_size - dst : hdr->block_size;
+	UINT64 clen = ctx->blockSizes[item] & ~IMGPACK_STORED;
+	const UINT8 *src = (const UINT8 *) (ctx->scratch + unpack->offsets[item]);
+	BOOLEAN ok;
+
+	if (ctx->blockSizes[item] & IMGPACK_STORED) {
+		ok = (clen == len);
+		if (ok)
+			CopyBytes((VOID *) (ctx->base + dst), src, len);
+	} else {
+		ok = Lz4Decompress(src, clen, (UINT8 *) (ctx->base + dst), len);
+	}
+	if (!ok)
+		__atomic_store_n(&ctx->unpackFailed, 1, __ATOMIC_RELAXED);
+}
+
+// Blocks are independent, so they are unpacked on all processors
+static EFI_STATUS FinishPacked(load_ctx_t *ctx)
+{
+	imgpack_header_t *hdr = &ctx->pack;
+	UINT64 packed = EFI_PAGES_TO_SIZE(ctx->scratchPages), src = 0;
+	UINT64 start = ReadTsc();
+	unpack_job_t unpack = { ctx, NULL };
+	par_job_t job = { UnpackItem, &unpack, hdr->block_count, 0, 0 };
+	UINTN i;
+
+	unpack.offsets = AllocatePool(hdr->block_count * sizeof(UINT64));
+	if (unpack.offsets == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	for (i = 0; i < hdr->block_count; i++) {
+		UINT64 clen = ctx->blockSizes[i] & ~IMGPACK_STORED;
+
+		if (clen > packed - src) {
+			FreePool(unpack.offsets);
+			return EFI_COMPROMISED_DATA;
+		}
+		unpack.offsets[i] = src;
+		src += clen;
+	}
+
+	ctx->unpackFailed = 0;
+	RunParallel(&job, L"Unpack");
+	FreePool(unpack.offsets);
+	if (ctx->unpackFailed)
+		return EFI_COMPROMISED_DATA;
+	ZeroBytes((VOID *) (ctx->base + hdr->raw_size), hdr->mem_size - hdr->raw_size);
+	ctx->unpackTicks = ReadTsc() - start;
+	return EFI_SUCCESS;
+}
+
+// Frees whatever a partially loaded module holds (no reads may be queued)
+static VOID DiscardLoad(load_ctx_t *ctx)
+{
+	if (ctx->numPages != 0)
+		FreePages(ctx->base, ctx->numPages);
+	if (ctx->scratchPages != 0)
+		FreePages(ctx->scratch, ctx->scratchPages);
+	if (ctx->blockSizes != NULL)
+		FreePool(ctx->blockSizes);
+	if (ctx->fh != NULL)
+		ctx->fh->Close(ctx->fh);
+	BootServices->SetMem(ctx, sizeof(*ctx), 0);
+}
+
+// Sizes the file with EFI_FILE_INFO and queues its reads. Packed and ELF
+// images are recognized by their magic; anything else is loaded as a flat
+// binary.
+static EFI_STATUS PrepareLoad(load_ctx_t *ctx)
+{
+	UINT32 magic = 0;
+	EFI_STATUS efi_status;
+
+	efi_status = GetFileSize(ctx->fh, &ctx->fileSize);
+	if (EFI_ERROR(efi_status))
 		return efi_status;
+	if (ctx->fileSize >= sizeof(magic)) {
+		efi_status = ReadAt(ctx, 0, &magic, sizeof(magic));
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+	}
+	if (magic == IMGPACK_MAGIC && ctx->fileSize >= sizeof(imgpack_header_t))
+		return PreparePacked(ctx);
+	if (magic == ELF_MAGIC && ctx->fileSize >= sizeof(Elf64_Ehdr))
+		return PrepareElf(ctx);
+	return PrepareFlat(ctx);
+}
+
+// "NAME: <bytes read> of <file size> bytes, <bytes> in memory", and for
+// packed images "(<bytes> bytes unpacked in <us> us)"
+static VOID ReportLoad(const load_ctx_t *ctx)
+{
+	PrintAscii(ctx->name);
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, L": ");
+	PrintDec(ctx->bytesRead);
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, L" of ");
+	PrintDec(ctx->fileSize);
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, L" bytes, ");
+	PrintDec(EFI_PAGES_TO_SIZE(ctx->numPages));
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, L" in memory");
+	if (ctx->blockSizes != NULL) {
+		SystemTable->ConOut->OutputString(SystemTable->ConOut, L" (");
+		PrintDec(ctx->pack.raw_size);
+		SystemTable->ConOut->OutputString(SystemTable->ConOut, L" bytes unpacked in ");
+		PrintDec(TscToUs(ctx->unpackTicks));
+		SystemTable->ConOut->OutputString(SystemTable->ConOut, L" us)");
+	}
+	SystemTable->ConOut->OutputString(SystemTable->ConOut, L"\r\n");
+}
+
+/*
+ * The boot manifest, \EFI\BOOT\MODULES: one module per line, "NAME [PATH]",
+ * where PATH defaults to \EFI\BOOT\NAME; '#' starts a comment. Without a
+ * manifest, KERNEL and (if present) USER are loaded.
+ */
+#define MANIFEST_PATH	L"\\EFI\\BOOT\\MODULES"
+#define MANIFEST_MAX	4096
+#define MODULE_DIR	L"\\EFI\\BOOT\\"
+#define MODULE_PATH_MAX	64
+
+typedef struct {
+	char name[BOOT_MODULE_NAME_MAX];
+	CHAR16 path[MODULE_PATH_MAX];
+	BOOLEAN optional;
+} manifest_entry_t;
+
+static VOID SetModule(manifest_entry_t *entry, const char *name, UINTN nameLen,
+		      const char *path, UINTN pathLen)
+{
+	const CHAR16 *dir = MODULE_DIR;
+	UINTN i, j = 0;
+
+	for (i = 0; i < nameLen && i < BOOT_MODULE_NAME_MAX - 1; i++)
+		entry->name[i] = name[i];
+	entry->name[i] = '\0';
+	if (pathLen == 0) {
+		while (*dir != L'\0')
+			entry->path[j++] = *dir++;
+		path = entry->name;
+		pathLen = i;
+	}
+	for (i = 0; i < pathLen && j < MODULE_PATH_MAX - 1; i++)
+		entry->path[j++] = (CHAR16) path[i];
+	entry->path[j] = L'\0';
+	entry->optional = FALSE;
+}
+
+static UINTN ParseManifest(const char *text, UINTN size, manifest_entry_t *entries)
+{
+	UINTN pos = 0, count = 0;
+
+	while (pos < size) {
+		const char *field[2] = { NULL, NULL };
+		UINTN len[2] = { 0, 0 }, n = 0;
+
+		while (pos < size && text[pos] != '\n') {
+			if (text[pos] == '#') {
+				while (pos < size && text[pos] != '\n')
+					pos++;
+				break;
+			}
+			if (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r') {
+				pos++;
+				continue;
+			}
+			if (n == 2)
+				n = 3; // extra fields, ignore the line
+			else if (n < 2)
+				field[n] = &text[pos];
+			while (pos < size && text[pos] != ' ' && text[pos] != '\t' &&
+			       text[pos] != '\r' && text[pos] != '\n' && text[pos] != '#') {
+				pos++;
+				if (n < 2)
+					len[n]++;
+			}
+			if (n < 2)
+				n++;
+		}
+		pos++;
+		if (n == 0 || n == 3)
+			continue;
+		if (count == BOOT_MODULES_MAX) {
+			SystemTable->ConOut->OutputString(SystemTable->ConOut,
+				L"Too many modules in the manifest\r\n");
+			break;
+		}
+		SetModule(&entries[count++], field[0], len[0], field[1], len[1]);
 	}
+	return count;
+}
+
+static UINTN ReadManifest(EFI_FILE_PROTOCOL *vh, manifest_entry_t *entries)
+{
+	load_ctx_t ctx;
+	char *text;
+	UINTN count = 0;
+
+	BootServices->SetMem(&ctx, sizeof(ctx), 0);
+	if (!EFI_ERROR(vh->Open(vh, &ctx.fh, MANIFEST_PATH, EFI_FILE_MODE_READ, 0))) {
+		if (!EFI_ERROR(GetFileSize(ctx.fh, &ctx.fileSize)) && ctx.fileSize <= MANIFEST_MAX &&
+		    (text = AllocatePool(ctx.fileSize + 1)) != NULL) {
+			if (!EFI_ERROR(ReadAt(&ctx, 0, text, ctx.fileSize)))
+				count = ParseManifest(text, ctx.fileSize, entries);
+			FreePool(text);
+		}
+		ctx.fh->Close(ctx.fh);
+		if (count != 0)
+			return count;
+		SystemTable->ConOut->OutputString(SystemTable->ConOut,
+			L"Cannot use the MODULES manifest\r\n");
+	}
+
+	SetModule(&entries[0], "KERNEL", 6, NULL, 0);
+	SetModule(&entries[1], "USER", 4, NULL, 0);
+	entries[1].optional = TRUE;
+	return 2;
+}
+
+/*
+ * Loads every module in the manifest from a single volume handle: all
+ * headers are parsed and all reads queued first, then the loader waits for
+ * the reads and finishes (unpacks) the modules in the manifest order.
+ */
+static EFI_STATUS LoadModules(EFI_FILE_PROTOCOL *vh, boot_info_t *bi)
+{
+	static manifest_entry_t entries[BOOT_MODULES_MAX];
+	static load_ctx_t loads[BOOT_MODULES_MAX];
+	UINT64 start = ReadTsc(), bytes = 0;
+	UINTN i, j, count;
+	EFI_STATUS efi_status = EFI_SUCCESS;
+
+	count = ReadManifest(vh, entries);
+	BootServices->SetMem(loads, sizeof(loads), 0);
+	for (i = 0; i < count; i++) {
+		load_ctx_t *ctx = &loads[i];
+
+		for (j = 0; j < BOOT_MODULE_NAME_MAX; j++)
+			ctx->name[j] = entries[i].name[j];
+		efi_status = vh->Open(vh, &ctx->fh, entries[i].path, EFI_FILE_MODE_READ, 0);
+		if (EFI_ERROR(efi_status)) {
+			ctx->fh = NULL;
+			if (entries[i].optional) {
+				efi_status = EFI_SUCCESS;
+				continue;
+			}
+			SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Cannot open ");
+			SystemTable->ConOut->OutputString(SystemTable->ConOut, entries[i].path);
+			SystemTable->ConOut->OutputString(SystemTable->ConOut, L"\r\n");
+			break;
+		}
+		efi_status = PrepareLoad(ctx);
+		if (EFI_ERROR(efi_status))
+			break;
+	}
+	Mark(bi, "Queue reads");
+
+	// Reads must be done before any buffer is freed or unpacked
+	if (!EFI_ERROR(WaitReads()) && !EFI_ERROR(efi_status)) {
+		Mark(bi, "Wait reads");
+		for (i = 0; i < count; i++) {
+			load_ctx_t *ctx = &loads[i];
+
+			if (ctx->fh == NULL)
+				continue;
+			if (ctx->blockSizes != NULL) {
+				efi_status = FinishPacked(ctx);
+				if (EFI_ERROR(efi_status))
+					break;
+			}
+			ReportLoad(ctx);
+			bytes += ctx->bytesRead;
+		}
+	} else if (!EFI_ERROR(efi_status)) {
+		efi_status = EFI_DEVICE_ERROR;
+	}
+
+	if (!EFI_ERROR(efi_status)) {
+		for (i = 0; i < count; i++) {
+			load_ctx_t *ctx = &loads[i];
+
+			if (ctx->fh == NULL)
+				continue;
+			AddModule(bi, ctx->name, ctx->base, EFI_PAGES_TO_SIZE(ctx->numPages),
+				  ctx->base + ctx->entry);
+			ctx->numPages = 0; // now owned by bi
+		}
+		PrintDec(bi->module_count);
+		SystemTable->ConOut->OutputString(SystemTable->ConOut, L" modules, ");
+		PrintDec(bytes);
+		SystemTable->ConOut->OutputString(SystemTable->ConOut, L" bytes in ");
+		PrintDec(TscToUs(ReadTsc() - start));
+		SystemTable->ConOut->OutputString(SystemTable->ConOut,
+			QueuedReads != 0 ? L" us (overlapped reads)\r\n" : L" us (synchronous reads)\r\n");
+	}
+	for (i = 0; i < count; i++)
+		DiscardLoad(&loads[i]);
+	Mark(bi, "Finish modules");
+	return efi_status;
+}
+
+static const boot_module_t *FindModule(const boot_info_t *bi, const char *name)
+{
+	UINT32 i;
+	for (i = 0; i < bi->module_count; i++) {
+		const char *a = bi->modules[i].name, *b = name;
+		while (*a != '\0' && *a == *b) {
+			a++;
+			b++;
+		}
+		if (*a == *b)
+			return &bi->modules[i];
+	}
+	return NULL;
+}
+
+#ifdef BOOT_PAGE_TABLES
+
+#define PTE_P		0x001ULL
+#define PTE_W		0x002ULL
+#define PTE_PS		0x080ULL
+#define PTE_G		0x100ULL	/* kept across CR3 loads once the kernel sets CR4.PGE */
+#define PT_ENTRIES	512
+#define DIRECT_MAP_PML4	256	/* 0xFFFF800000000000 */
+#define IDENTITY_MAP_MIN	SIZE_4GB	/* MMIO and firmware tables */
+#define IDENTITY_MAP_MAX	SIZE_512GB	/* one PML4 entry */
+
+static BOOLEAN HasPage1G(void)
+{
+	UINT32 eax, ebx, ecx, edx;
+
+	__asm__ __volatile__ ("cpuid"
+		: "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+		: "a" (0x80000000), "c" (0));
+	if (eax < 0x80000001)
+		return FALSE;
+	__asm__ __volatile__ ("cpuid"
+		: "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+		: "a" (0x80000001), "c" (0));
+	return (edx & (1U << 26)) != 0;
+}
+
+// The end of the highest range in the current memory map (or the framebuffer)
+static EFI_STATUS GetPhysTop(const boot_info_t *bi, UINT64 *top)
+{
+	EFI_MEMORY_DESCRIPTOR *map;
+	UINTN mapSize = 0, mapKey, descSize, off;
+	UINT32 descVersion;
+	EFI_STATUS efi_status;
+
+	efi_status = BootServices->GetMemoryMap(&mapSize, NULL, &mapKey, &descSize, &descVersion);
+	if (efi_status != EFI_BUFFER_TOO_SMALL)
+		return EFI_ERROR(efi_status) ? efi_status : EFI_DEVICE_ERROR;
+	mapSize += 4 * descSize;
+	map = AllocatePool(mapSize);
+	if (map == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	efi_status = BootServices->GetMemoryMap(&mapSize, map, &mapKey, &descSize, &descVersion);
+	if (!EFI_ERROR(efi_status)) {
+		*top = bi->fb_base + bi->fb_size;
+		for (off = 0; off + descSize <= mapSize; off += descSize) {
+			EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR *) ((UINT8 *) map + off);
+			UINT64 end = desc->PhysicalStart + EFI_PAGES_TO_SIZE(desc->NumberOfPages);
+			if (end > *top)
+				*top = end;
+		}
+	}
+	FreePool(map);
+	return efi_status;
+}
+
+// Builds the kernel page tables while boot services are still around: the
+// same layout the kernel would build (1 GiB pages if supported, 2 MiB pages
+// otherwise, 4 KiB pages for the first 2 MiB), in one EfiLoaderData block
+// that the kernel never hands to its frame allocator. PML4[511] is left to
+// the kernel for user space. PML4[256] aliases the identity map at
+// 0xFFFF800000000000; the kernel still runs from its low addresses.
+static EFI_STATUS BuildPageTables(boot_info_t *bi)
+{
+	BOOLEAN gbPages = HasPage1G();
+	EFI_PHYSICAL_ADDRESS tables;
+	UINT64 *pml, *pdp, *pd, *pt, top = 0, gib, g;
+	UINTN i, num_pages;
+	EFI_STATUS efi_status;
+
+	efi_status = GetPhysTop(bi, &top);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+	if (top < IDENTITY_MAP_MIN)
+		top = IDENTITY_MAP_MIN;
+	if (top > IDENTITY_MAP_MAX)
+		top = IDENTITY_MAP_MAX;
+	gib = (top + SIZE_1GB - 1) / SIZE_1GB;
 
-	// Load the User
-    // Seek to the beginning of the file
-    efi_status = u_fh->SetPosition(u_fh, 0);
-    if (EFI_ERROR(efi_status)) {
-        SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to load user!\r\n");
+	// PML4, PDPT, the first GiB's PD and PT, then one PD per other GiB
+	num_pages = 4 + (gbPages ? 0 : gib - 1);
+	efi_status = BootServices->AllocatePages(AllocateAnyPages, EfiLoaderData, num_pages, &tables);
+	if (EFI_ERROR(efi_status))
 		return efi_status;
-    }
+	BootServices->SetMem((VOID *) tables, EFI_PAGES_TO_SIZE(num_pages), 0);
+	pml = (UINT64 *) tables;
+	pdp = pml + PT_ENTRIES;
+	pd = pdp + PT_ENTRIES;
+	pt = pd + PT_ENTRIES;
 
-	// //Allocate user buffer 
-	EFI_PHYSICAL_ADDRESS ucode;
-	UINTN num_ucode_pages = (SIZE_1MB / EFI_PAGE_SIZE);
+	for (i = 0; i < PT_ENTRIES; i++)
+		pt[i] = EFI_PAGES_TO_SIZE(i) | PTE_P | PTE_W | PTE_G;
+	pd[0] = (UINT64) pt | PTE_P | PTE_W;
+	for (i = 1; i < PT_ENTRIES; i++)
+		pd[i] = (i * SIZE_2MB) | PTE_P | PTE_W | PTE_PS | PTE_G;
+	pdp[0] = (UINT64) pd | PTE_P | PTE_W;
+
+	pd = pt + PT_ENTRIES;
+	for (g = 1; g < gib; g++) {
+		if (gbPages) {
+			pdp[g] = (g * SIZE_1GB) | PTE_P | PTE_W | PTE_PS | PTE_G;
+			continue;
+		}
+		for (i = 0; i < PT_ENTRIES; i++)
+			pd[i] = (g * SIZE_1GB + i * SIZE_2MB) | PTE_P | PTE_W | PTE_PS | PTE_G;
+		pdp[g] = (UINT64) pd | PTE_P | PTE_W;
+		pd += PT_ENTRIES;
+	}
+	pml[0] = (UINT64) pdp | PTE_P | PTE_W;
+	pml[DIRECT_MAP_PML4] = pml[0];
+
+	bi->cr3 = (UINT64) pml;
+	bi->page_tables_size = EFI_PAGES_TO_SIZE(num_pages);
+	bi->identity_map_size = gib * SIZE_1GB;
+	return EFI_SUCCESS;
+}
 
-	efi_status = BootServices->AllocatePages(AllocateAnyPages, EfiBootServicesData, num_ucode_pages, &ucode);
-	if (efi_status != EFI_SUCCESS) {
-		SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to allocate ucode buffer!\r\n");
-        return RETURN_OUT_OF_RESOURCES;
-    }
+#endif
 
-    // Read the file content into the buffer
-	numToRead = SIZE_1MB;
-	efi_status = u_fh->Read(u_fh, &numToRead, (void *)ucode);
+/* Use System V ABI rather than EFI/Microsoft ABI. */
+typedef void (*kernel_entry_t) (void *, boot_info_t *) __attribute__((sysv_abi));
+EFI_STATUS EFIAPI
+efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable)
+{
+	///////////////////////
+	// Part 1: 
+	UINT64 start = ReadTsc();
+	EFI_FILE_PROTOCOL *vh;
+	EFI_STATUS efi_status;
+	UINT32 *fb;
+	boot_info_t *bi;
+	const boot_module_t *kernel;
+	
+	ImageHandle = imageHandle;
+	SystemTable = systemTable;
+	BootServices = systemTable->BootServices;
+
+	// The handoff block for the kernel, filled in as we go
+	bi = AllocatePool(sizeof(boot_info_t));
+	if (bi == NULL) {
+		SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to allocate boot info!\r\n");
+		return RETURN_OUT_OF_RESOURCES;
+	}
+	BootServices->SetMem(bi, sizeof(boot_info_t), 0);
+	bi->magic = BOOT_INFO_MAGIC;
+	bi->version = BOOT_INFO_VERSION;
+	bi->size = sizeof(boot_info_t);
+	bi->rsdp = FindRsdp();
+	Mark(bi, "efi_main");
+	bi->marks[0].tsc = start;
+	CalibrateTsc();
+	bi->tsc_khz = TscKhz;
+	Mark(bi, "CalibrateTsc");
+	InitMp();
+	Mark(bi, "InitMp");
+
+	efi_status = OpenVolume(&vh);
 	if (EFI_ERROR(efi_status)) {
-		SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to read user!\r\n");
-		FreePool(kernelBuffer);
-		FreePages(ucode, num_ucode_pages);
+		BootServices->Stall(5 * 1000000); // 5 seconds
 		return efi_status;
 	}
+	Mark(bi, "OpenVolume");
 
-	CloseUser(u_vh, u_fh);
+	// Load the kernel, user programs and anything else in the manifest
+	efi_status = LoadModules(vh, bi);
+	vh->Close(vh);
+	kernel = FindModule(bi, "KERNEL");
+	if (EFI_ERROR(efi_status) || kernel == NULL) {
+		SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to load modules!\r\n");
+		FreeModules(bi);
+		BootServices->Stall(5 * 1000000); // 5 seconds
+		return EFI_ERROR(efi_status) ? efi_status : EFI_NOT_FOUND;
+	}
+
+	fb = SetGraphicsMode(800, 600, bi);
+	if (fb == NULL) {
+		// Handle error
+		FreeModules(bi);
+		return RETURN_UNSUPPORTED;
+	}
+	Mark(bi, "SetGraphicsMode");
+
+	kernel_entry_t func = (kernel_entry_t) (UINTN) kernel->entry;
 
 
 	//Allocate memory to be passed into kernal
@@ -311,27 +1422,22 @@ efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable)
 	efi_status = BootServices->AllocatePages(AllocateAnyPages, EfiBootServicesData, num_mem_pages, &memoryBuffer);
 	if(efi_status != EFI_SUCCESS)
 	{
-		FreePages(ucode, num_ucode_pages);
-		FreePool(kernelBuffer);
+		FreeModules(bi);
 		SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to allocate memory!\r\n");
 		return efi_status;
 	}
+	bi->memory = memoryBuffer;
+	bi->memory_size = memoryBufferSize;
+	Mark(bi, "AllocatePages memory");
 
-	//Allocate ustack
-	EFI_PHYSICAL_ADDRESS ustack;
-	UINTN num_ustack_pages = (SIZE_1MB / EFI_PAGE_SIZE);
+#ifdef BOOT_MP_BENCH
+	// Only a benchmark of a large, even split: the kernel zeroes what it
+	// allocates from this memory, so nothing needs it cleared
+	ParallelZero((VOID *) memoryBuffer, memoryBufferSize, L"Zero memory");
+	Mark(bi, "Zero memory");
+#endif
 
-	efi_status = BootServices->AllocatePages(AllocateAnyPages, EfiBootServicesData, num_ustack_pages, &ustack);
-	if(efi_status != EFI_SUCCESS)
-	{
-		FreePages(ucode, num_ucode_pages);
-		FreePages(memoryBuffer, num_mem_pages);
-		FreePool(kernelBuffer);
-		SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to allocate ustack!\r\n");
-		return efi_status;
-	}
-	//Set pointer to end of buffer
-	ustack = (EFI_PHYSICAL_ADDRESS)((void *)ustack + SIZE_1MB);
+	// The user stack is allocated by the kernel
 
 	//Allocate kstack
 	EFI_PHYSICAL_ADDRESS kstack;
@@ -340,15 +1446,23 @@ efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable)
 	efi_status = BootServices->AllocatePages(AllocateAnyPages, EfiBootServicesData, num_kstack_pages, &kstack);
 	if(efi_status != EFI_SUCCESS)
 	{
-		FreePages(ustack, num_ustack_pages);
-		FreePages(ucode, num_ucode_pages);
 		FreePages(memoryBuffer, num_mem_pages);
-		FreePool(kernelBuffer);
+		FreeModules(bi);
 		SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to allocate kstack!\r\n");
 		return efi_status;
 	}
 	//Set pointer to end of buffer
 	kstack = (EFI_PHYSICAL_ADDRESS)((void *)kstack + SIZE_1MB);
+	Mark(bi, "AllocatePages kstack");
+
+#ifdef BOOT_PAGE_TABLES
+	// Optional: the kernel skips its own table build if cr3 is set
+	efi_status = BuildPageTables(bi);
+	if (EFI_ERROR(efi_status))
+		SystemTable->ConOut->OutputString(SystemTable->ConOut,
+			L"Cannot build page tables, the kernel will do it\r\n");
+	Mark(bi, "BuildPageTables");
+#endif
 
 	/////////////////
 	//Part 2:
@@ -357,8 +1471,10 @@ efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable)
     UINTN mapKey, mapDescriptorSize;
 	UINTN mapSize = 0;
     UINT32 mapDescriptorVersion;
+	UINT32 mapRounds = 0;
 
 	do{
+		mapRounds++;
 		mapSize = 0;
 		memoryMap = NULL;
 
@@ -366,23 +1482,21 @@ efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable)
 		efi_status = BootServices->GetMemoryMap(&mapSize, memoryMap, &mapKey, &mapDescriptorSize, &mapDescriptorVersion);
 		if (efi_status != EFI_BUFFER_TOO_SMALL) {
 			FreePages(kstack, num_kstack_pages);
-			FreePages(ustack, num_ustack_pages);
-			FreePages(ucode, num_ucode_pages);
 			FreePages(memoryBuffer, num_mem_pages);
-			FreePool(kernelBuffer); // Free allocated buffers
+			FreeModules(bi); // Free allocated buffers
 			SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to retrieve memory map size!\r\n");
 			return efi_status;
 		}
 
-		// Allocate memory for memoryMap
+		// Allocate memory for memoryMap, with some slack since
+		// the allocation itself can split a descriptor
+		mapSize += 4 * mapDescriptorSize;
 		memoryMap = AllocatePool(mapSize);
 		if(memoryMap == NULL) // Return error if allocation was unsuccessful 
 		{
 			FreePages(kstack, num_kstack_pages);
-			FreePages(ustack, num_ustack_pages);
-			FreePages(ucode, num_ucode_pages);
 			FreePages(memoryBuffer, num_mem_pages);
-			FreePool(kernelBuffer); // Free allocated buffers
+			FreeModules(bi); // Free allocated buffers
 			SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to allocate memoryMap buffer!\r\n");
 			return RETURN_OUT_OF_RESOURCES;
 		}
@@ -391,10 +1505,8 @@ efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable)
 		efi_status = BootServices->GetMemoryMap(&mapSize, memoryMap, &mapKey, &mapDescriptorSize, &mapDescriptorVersion);
 		if (efi_status != EFI_SUCCESS) { // Return error if retrieval not successful 
 			FreePages(kstack, num_kstack_pages);
-			FreePages(ustack, num_ustack_pages);
-			FreePages(ucode, num_ucode_pages);
 			FreePages(memoryBuffer, num_mem_pages);
-			FreePool(kernelBuffer);
+			FreeModules(bi);
 			FreePool(memoryMap); // Free allocated buffers
 			SystemTable->ConOut->OutputString(SystemTable->ConOut, L"Failed to retrieve memoryMap!\r\n");
 			return efi_status;
@@ -409,8 +1521,16 @@ efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable)
 			}
 		}
 	}while(efi_status != EFI_SUCCESS);
+	bi->map_retries = mapRounds - 1;
+	Mark(bi, "ExitBootServices");
+
+	// The final memory map goes to the kernel
+	bi->memory_map = (uint64_t) memoryMap;
+	bi->memory_map_size = mapSize;
+	bi->memory_desc_size = mapDescriptorSize;
+	bi->memory_desc_version = mapDescriptorVersion;
 	
 	/////////////////
-	func((void *) kstack, (void *) ustack, fb, 800, 600, (void *) ucode, (void *) memoryBuffer, memoryBufferSize);
+	func((void *) kstack, bi);
 	return EFI_SUCCESS;
 }
@@ -0,0 +1,317 @@
+/*
+ * imgpack.c - packs a KERNEL/USER image for the boot loader
+ *
+ * The PT_LOAD segments of an ELF64 file (or a whole flat binary) are laid
+ * out the way the loader would place them in memory and compressed with the
+ * LZ4 block format, in independent blocks. The loader (boot/boot.c) detects
+ * IMGPACK_MAGIC, reads the compressed blocks and decompresses them straight
+ * into the final allocation; bytes past raw_size (.bss) are zeroed.
+ *
+ * File layout:
+ *   imgpack_header_t
+ *   uint32_t block_sizes[block_count]   compressed sizes, IMGPACK_STORED
+ *                                       marks an uncompressed block
+ *   the blocks, back to back
+ *
+ * Usage: imgpack <input> <output>
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Must match boot/boot.c */
+#define IMGPACK_MAGIC	0x4B504D49U	/* "IMPK" */
+#define IMGPACK_BLOCK	(128U << 10)	/* uncompressed bytes per block */
+#define IMGPACK_STORED	0x80000000U
+
+typedef struct {
+	uint32_t magic;
+	uint32_t block_size;
+	uint32_t block_count;
+	uint32_t reserved;
+	uint64_t entry;		/* entry point, relative to the image start */
+	uint64_t raw_size;	/* bytes that the blocks decompress to */
+	uint64_t mem_size;	/* bytes the image occupies in memory */
+} imgpack_header_t;
+
+/* The parts of the ELF64 format that we need (no <elf.h> on some hosts) */
+#define ELF_MAGIC	0x464C457FU
+#define ELFCLASS64	2
+#define PT_LOAD		1
+#define PAGE_SIZE	4096U
+
+typedef struct {
+	uint8_t  e_ident[16];
+	uint16_t e_type;
+	uint16_t e_machine;
+	uint32_t e_version;
+	uint64_t e_entry;
+	uint64_t e_phoff;
+	uint64_t e_shoff;
+	uint32_t e_flags;
+	uint16_t e_ehsize;
+	uint16_t e_phentsize;
+	uint16_t e_phnum;
+	uint16_t e_shentsize;
+	uint16_t e_shnum;
+	uint16_t e_shstrndx;
+} Elf64_Ehdr;
+
+typedef struct {
+	uint32_t p_type;
+	uint32_t p_flags;
+	uint64_t p_offset;
+	uint64_t p_vaddr;
+	uint64_t p_paddr;
+	uint64_t p_filesz;
+	uint64_t p_memsz;
+	uint64_t p_align;
+} Elf64_Phdr;
+
+/* LZ4 block format limits */
+#define MINMATCH	4
+#define LASTLITERALS	5	/* the last 5 bytes are always literals */
+#define MFLIMIT		12	/* no match starts within the last 12 bytes */
+#define HASH_LOG	16
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash32(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static int put_length(uint8_t *dst, size_t cap, size_t *op, size_t len)
+{
+	while (len >= 255) {
+		if (*op >= cap)
+			return -1;
+		dst[(*op)++] = 255;
+		len -= 255;
+	}
+	if (*op >= cap)
+		return -1;
+	dst[(*op)++] = (uint8_t) len;
+	return 0;
+}
+
+/* One sequence: literals, then a match (mlen == 0 for the final one) */
+static int put_sequence(uint8_t *dst, size_t cap, size_t *op, const uint8_t *lit,
+			size_t litlen, size_t offset, size_t mlen)
+{
+	size_t ml = mlen ? mlen - MINMATCH : 0;
+
+	if (*op >= cap)
+		return -1;
+	dst[(*op)++] = (uint8_t) (((litlen < 15 ? litlen : 15) << 4) | (ml < 15 ? ml : 15));
+	if (litlen >= 15 && put_length(dst, cap, op, litlen - 15) < 0)
+		return -1;
+	if (cap - *op < litlen)
+		return -1;
+	memcpy(dst + *op, lit, litlen);
+	*op += litlen;
+	if (mlen == 0)
+		return 0;
+	if (cap - *op < 2)
+		return -1;
+	dst[(*op)++] = (uint8_t) offset;
+	dst[(*op)++] = (uint8_t) (offset >> 8);
+	if (ml >= 15 && put_length(dst, cap, op, ml - 15) < 0)
+		return -1;
+	return 0;
+}
+
+/* Greedy LZ4 block compressor; returns 0 if the output would not fit 'cap' */
+static size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+	static uint32_t table[1U << HASH_LOG]; /* position + 1, 0 is empty */
+	size_t ip = 0, anchor = 0, op = 0;
+
+	memset(table, 0, sizeof(table));
+	if (n > MFLIMIT) {
+		size_t limit = n - MFLIMIT;
+
+		while (ip < limit) {
+			uint32_t seq = read32(src + ip);
+			uint32_t h = hash32(seq);
+			size_t ref = table[h];
+
+			table[h] = (uint32_t) ip + 1;
+			if (ref != 0 && ip - (ref - 1) <= 65535 && read32(src + ref - 1) == seq) {
+				size_t mlen = MINMATCH;
+
+				ref--;
+				while (ip + mlen < n - LASTLITERALS && src[ref + mlen] == src[ip + mlen])
+					mlen++;
+				if (put_sequence(dst, cap, &op, src + anchor, ip - anchor,
+						 ip - ref, mlen) < 0)
+					return 0;
+				ip += mlen;
+				anchor = ip;
+			} else {
+				ip++;
+			}
+		}
+	}
+	if (put_sequence(dst, cap, &op, src + anchor, n - anchor, 0, 0) < 0)
+		return 0;
+	return op;
+}
+
+static uint8_t *read_file(const char *path, size_t *size)
+{
+	FILE *f = fopen(path, "rb");
+	uint8_t *buf;
+	long len;
+
+	if (f == NULL)
+		return NULL;
+	if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return NULL;
+	}
+	buf = malloc(len ? len : 1);
+	if (buf != NULL && fread(buf, 1, len, f) != (size_t) len) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	*size = len;
+	return buf;
+}
+
+/* Lays the image out as the loader would; returns NULL on a malformed ELF */
+static uint8_t *flatten(const uint8_t *file, size_t size, imgpack_header_t *hdr)
+{
+	const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *) file;
+	const Elf64_Phdr *phdr;
+	uint64_t lo = ~0ULL, hi = 0, raw = 0;
+	uint8_t *image;
+	size_t i;
+
+	if (size < sizeof(*ehdr) || read32(file) != ELF_MAGIC) {
+		/* A flat binary, entered at its first byte */
+		image = malloc(size ? size : 1);
+		if (image != NULL)
+			memcpy(image, file, size);
+		hdr->entry = 0;
+		hdr->raw_size = size;
+		hdr->mem_size = size;
+		return image;
+	}
+
+	if (ehdr->e_ident[4] != ELFCLASS64 || ehdr->e_phentsize != sizeof(Elf64_Phdr) ||
+	    ehdr->e_phoff + (uint64_t) ehdr->e_phnum * sizeof(Elf64_Phdr) > size)
+		return NULL;
+	phdr = (const Elf64_Phdr *) (file + ehdr->e_phoff);
+
+	for (i = 0; i < ehdr->e_phnum; i++) {
+		if (phdr[i].p_type != PT_LOAD || phdr[i].p_memsz == 0)
+			continue;
+		if (phdr[i].p_filesz > phdr[i].p_memsz ||
+		    phdr[i].p_offset + phdr[i].p_filesz > size)
+			return NULL;
+		if (phdr[i].p_vaddr < lo)
+			lo = phdr[i].p_vaddr;
+		if (phdr[i].p_vaddr + phdr[i].p_memsz > hi)
+			hi = phdr[i].p_vaddr + phdr[i].p_memsz;
+	}
+	if (hi == 0)
+		return NULL;
+	lo &= ~(uint64_t) (PAGE_SIZE - 1);
+
+	for (i = 0; i < ehdr->e_phnum; i++) {
+		if (phdr[i].p_type == PT_LOAD && phdr[i].p_filesz != 0 &&
+		    phdr[i].p_vaddr - lo + phdr[i].p_filesz > raw)
+			raw = phdr[i].p_vaddr - lo + phdr[i].p_filesz;
+	}
+
+	image = calloc(1, raw ? raw : 1);
+	if (image == NULL)
+		return NULL;
+	for (i = 0; i < ehdr->e_phnum; i++) {
+		if (phdr[i].p_type == PT_LOAD && phdr[i].p_filesz != 0)
+			memcpy(image + (phdr[i].p_vaddr - lo), file + phdr[i].p_offset,
+			       phdr[i].p_filesz);
+	}
+	hdr->entry = ehdr->e_entry - lo;
+	hdr->raw_size = raw;
+	hdr->mem_size = hi - lo;
+	return image;
+}
+
+int main(int argc, char *argv[])
+{
+	imgpack_header_t hdr;
+	uint8_t *file, *image, *out;
+	uint32_t *sizes;
+	size_t size, i, packed = 0;
+	FILE *f;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <input> <output>\n", argv[0]);
+		return 1;
+	}
+	file = read_file(argv[1], &size);
+	if (file == NULL) {
+		fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	image = flatten(file, size, &hdr);
+	if (image == NULL) {
+		fprintf(stderr, "%s: %s is not a loadable image\n", argv[0], argv[1]);
+		return 1;
+	}
+	hdr.magic = IMGPACK_MAGIC;
+	hdr.block_size = IMGPACK_BLOCK;
+	hdr.block_count = (uint32_t) ((hdr.raw_size + IMGPACK_BLOCK - 1) / IMGPACK_BLOCK);
+
+	sizes = calloc(hdr.block_count + 1, sizeof(*sizes));
+	out = malloc((size_t) hdr.block_count * IMGPACK_BLOCK + 1);
+	if (sizes == NULL || out == NULL) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < hdr.block_count; i++) {
+		size_t off = i * IMGPACK_BLOCK;
+		size_t len = hdr.raw_size - off < IMGPACK_BLOCK ? hdr.raw_size - off : IMGPACK_BLOCK;
+		size_t clen = lz4_compress(image + off, len, out + packed, len - 1);
+
+		/* Keep a block as is unless compression saves something */
+		if (clen == 0) {
+			memcpy(out + packed, image + off, len);
+			sizes[i] = (uint32_t) len | IMGPACK_STORED;
+			packed += len;
+		} else {
+			sizes[i] = (uint32_t) clen;
+			packed += clen;
+		}
+	}
+
+	f = fopen(argv[2], "wb");
+	if (f == NULL || fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(sizes, sizeof(*sizes), hdr.block_count, f) != hdr.block_count ||
+	    fwrite(out, 1, packed, f) != packed || fclose(f) != 0) {
+		fprintf(stderr, "%s: cannot write %s\n", argv[0], argv[2]);
+		return 1;
+	}
+
+	printf("%s: %zu -> %zu bytes (%llu in memory, %u blocks)\n", argv[2], size,
+	       sizeof(hdr) + hdr.block_count * sizeof(*sizes) + packed,
+	       (unsigned long long) hdr.mem_size, hdr.block_count);
+	free(out);
+	free(sizes);
+	free(image);
+	free(file);
+	return 0;
+}
@@ -3,11 +3,30 @@
  * Copyright 2022 Ruslan Nikolaev <rnikola@psu.edu>
  */
 typedef unsigned int uint32_t;
+typedef unsigned long long uint64_t;
+
+/* The leading fields of boot_info_t (see boot/boot.c), which never move */
+typedef struct boot_info_s {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint64_t memory_map;
+	uint64_t memory_map_size;
+	uint64_t memory_desc_size;
+	uint32_t memory_desc_version;
+	uint32_t reserved0;
+	uint64_t fb_base;
+	uint64_t fb_size;
+	uint32_t fb_width;
+	uint32_t fb_height;
+} boot_info_t;
 
 //void kernel_start(unsigned int *framebuffer, int width, int height)
-void kernel_start(void *kstack, void *ustack, unsigned int *fb, int width, int height,
-		  void *ucode, void *memory, unsigned long memorySize)
+void kernel_start(void *kstack, boot_info_t *bi)
 {
+	unsigned int *fb = (unsigned int *) bi->fb_base;
+	int width = bi->fb_width, height = bi->fb_height;
+
     for(int i = 0; i < height/2; i++)
 	{
 		for(int w = 0; w < width/2; w++)
@@ -17,4 +36,4 @@ void kernel_start(void *kstack, void *ustack, unsigned int *fb, int width, int h
 	}
 	/* Never exit! */
 	while (1) {};
-}
\ No newline at end of file
+}
@@ -0,0 +1,319 @@
+/*
+ * bench.c - boot-time microbenchmarks
+ */
+
+#include <bench.h>
+#include <cpu.h>
+#include <numa.h>
+#include <page_alloc.h>
+#include <paging.h>
+#include <pcid.h>
+#include <printf.h>
+#include <proc.h>
+#include <string.h>
+#include <timeline.h>
+#include <user_layout.h>
+#include <vma.h>
+
+#define SWITCH_SPACES	4
+#define SWITCH_PAGES	32	/* heap pages touched after every switch */
+#define SWITCH_ROUNDS	1000
+
+/* Cycles per switch, each followed by a read of SWITCH_PAGES pages */
+static uint64_t switch_round_trip(struct process *spaces)
+{
+	uint64_t start;
+	size_t round, i, page;
+
+	start = rdtsc();
+	for (round = 0; round < SWITCH_ROUNDS; round++) {
+		for (i = 0; i < SWITCH_SPACES; i++) {
+			proc_switch(&spaces[i]);
+			for (page = 0; page < SWITCH_PAGES; page++)
+				(void) *(volatile uint64_t *) (USER_HEAP_VA + page * 4096);
+		}
+	}
+	return (rdtsc() - start) / (SWITCH_ROUNDS * SWITCH_SPACES);
+}
+
+void bench_switch(void)
+{
+	static struct process spaces[SWITCH_SPACES];
+	struct process *init = current_process;
+	uint16_t pcids[SWITCH_SPACES];
+	uint64_t tagged = 0, untagged;
+	size_t i, n;
+
+	for (n = 0; n < SWITCH_SPACES; n++) {
+		if (proc_create(&spaces[n]) < 0)
+			break;
+		if (proc_add_region(&spaces[n], USER_HEAP_VA, SWITCH_PAGES * 4096, PTE_U | PTE_W) < 0) {
+			proc_destroy(&spaces[n]);
+			break;
+		}
+	}
+	if (n < SWITCH_SPACES) {
+		printf("Switch benchmark: out of memory\n");
+		goto out;
+	}
+
+	/* The first round faults the pages in */
+	switch_round_trip(spaces);
+	if (spaces[0].pcid != 0)
+		tagged = switch_round_trip(spaces);
+	for (i = 0; i < SWITCH_SPACES; i++) {
+		pcids[i] = spaces[i].pcid;
+		spaces[i].pcid = 0;
+	}
+	untagged = switch_round_trip(spaces);
+	for (i = 0; i < SWITCH_SPACES; i++)
+		spaces[i].pcid = pcids[i];
+
+	if (tagged != 0)
+		printf("Switch + %u page reads: %llu cycles with PCIDs, %llu without\n",
+			SWITCH_PAGES, tagged, untagged);
+	else
+		printf("Switch + %u page reads: %llu cycles (%s)\n", SWITCH_PAGES, untagged,
+			pcid_enabled() ? "out of PCIDs" : "no PCID support");
+out:
+	proc_switch(init);
+	for (i = 0; i < n; i++)
+		proc_destroy(&spaces[i]);
+}
+
+#define VMA_AREAS	50000
+#define VMA_STRIDE	7919	/* a prime, visits every area once in scrambled order */
+#define VMA_GAP_SEARCHES	1000
+
+/* Area k: 2 pages at VMA_BASE + 3k pages, a 1-page gap after it */
+#define VMA_BASE	USER_MMAP_BASE
+#define VMA_AREA(k)	(VMA_BASE + (uint64_t) (k) * 3 * PAGE_SIZE)
+
+static size_t scrambled(size_t i)
+{
+	return (size_t) ((uint64_t) i * VMA_STRIDE % VMA_AREAS);
+}
+
+void bench_vma(void)
+{
+	struct vma_tree t;
+	uint64_t start, cycles[6];
+	const char *failed = NULL;
+	struct vma *v;
+	size_t i, k;
+
+	vma_tree_init(&t);
+
+	/* Flags alternate so that neighbours never merge */
+	start = rdtsc();
+	for (i = 0; i < VMA_AREAS && failed == NULL; i++) {
+		k = scrambled(i);
+		if (vma_insert(&t, VMA_AREA(k), VMA_AREA(k) + 2 * PAGE_SIZE, k & 1) == NULL)
+			failed = "insert";
+	}
+	cycles[0] = rdtsc() - start;
+	if (failed == NULL && (t.count != VMA_AREAS || vma_check(&t) < 0))
+		failed = "insert";
+
+	start = rdtsc();
+	for (i = 0; i < VMA_AREAS && failed == NULL; i++) {
+		k = scrambled(i);
+		v = vma_find(&t, VMA_AREA(k) + PAGE_SIZE + 8);
+		if (v == NULL || v->start != VMA_AREA(k) || vma_find(&t, VMA_AREA(k) - 8) != NULL)
+			failed = "find";
+	}
+	cycles[1] = rdtsc() - start;
+
+	/* All gaps are 1 page, a 2-page one is only found above the last area */
+	start = rdtsc();
+	for (i = 0; i < VMA_GAP_SEARCHES && failed == NULL; i++) {
+		if (vma_find_gap(&t, VMA_BASE, USER_MMAP_END, 2 * PAGE_SIZE, PAGE_SIZE) !=
+		    VMA_AREA(VMA_AREAS) - PAGE_SIZE)
+			failed = "gap search";
+	}
+	cycles[2] = rdtsc() - start;
+
+	start = rdtsc();
+	for (i = 0; i < VMA_AREAS && failed == NULL; i++) {
+		k = scrambled(i);
+		v = vma_find(&t, VMA_AREA(k));
+		if (v == NULL || vma_split(&t, v, VMA_AREA(k) + PAGE_SIZE) == NULL)
+			failed = "split";
+	}
+	cycles[3] = rdtsc() - start;
+	if (failed == NULL && (t.count != 2 * VMA_AREAS || vma_check(&t) < 0))
+		failed = "split";
+
+	start = rdtsc();
+	for (i = 0; i < VMA_AREAS && failed == NULL; i++) {
+		k = scrambled(i);
+		v = vma_find(&t, VMA_AREA(k));
+		if (v != NULL)
+			v = vma_merge(&t, v);
+		if (v == NULL || v->start != VMA_AREA(k) || v->end != VMA_AREA(k) + 2 * PAGE_SIZE)
+			failed = "merge";
+	}
+	cycles[4] = rdtsc() - start;
+	if (failed == NULL && (t.count != VMA_AREAS || vma_check(&t) < 0))
+		failed = "merge";
+
+	start = rdtsc();
+	for (i = 0; i < VMA_AREAS && failed == NULL; i++) {
+		v = vma_find(&t, VMA_AREA(scrambled(i)));
+		if (v == NULL)
+			failed = "remove";
+		else
+			vma_remove(&t, v);
+	}
+	cycles[5] = rdtsc() - start;
+	if (failed == NULL && (t.count != 0 || vma_check(&t) < 0))
+		failed = "remove";
+
+	vma_tree_destroy(&t);
+	if (failed != NULL) {
+		printf("VMA tree: FAILED (%s)\n", failed);
+		return;
+	}
+	printf("VMA tree, %u areas, cycles/op: insert %llu, find %llu, gap search %llu, "
+		"split %llu, merge %llu, remove %llu\n", VMA_AREAS,
+		cycles[0] / VMA_AREAS, cycles[1] / VMA_AREAS, cycles[2] / VMA_GAP_SEARCHES,
+		cycles[3] / VMA_AREAS, cycles[4] / VMA_AREAS, cycles[5] / VMA_AREAS);
+}
+
+#define FORK_HEAP_MAX	(64ULL << 20)
+#define FORK_ROUNDS	4
+
+/* Cycles to fork 'parent' (loaded) with or without copy-on-write, 0 if out of memory */
+static uint64_t fork_cycles(struct process *parent, bool cow)
+{
+	static struct process child;
+	uint64_t start, total = 0;
+	size_t round;
+
+	for (round = 0; round < FORK_ROUNDS; round++) {
+		start = rdtsc();
+		if (proc_fork(&child, parent, cow) < 0)
+			return 0;
+		total += rdtsc() - start;
+		proc_destroy(&child);
+	}
+	return total / FORK_ROUNDS;
+}
+
+/* One write per heap page in [from, to) */
+static void touch_heap(uint64_t from, uint64_t to)
+{
+	for (; from < to; from += PAGE_SIZE)
+		*(volatile uint64_t *) (USER_HEAP_VA + from) = from;
+}
+
+void bench_fork(void)
+{
+	static struct process parent, child;
+	struct process *init = current_process;
+	uint64_t len, mapped = 0, cow, eager, start, writes;
+
+	if (proc_create(&parent) < 0) {
+		printf("Fork benchmark: out of memory\n");
+		return;
+	}
+	if (proc_add_region(&parent, USER_HEAP_VA, FORK_HEAP_MAX, PTE_U | PTE_W) < 0) {
+		printf("Fork benchmark: out of memory\n");
+		goto out;
+	}
+	proc_switch(&parent);
+
+	/* A heap of 4 KiB pages, as demand faults leave it */
+	for (len = 4ULL << 20; len <= FORK_HEAP_MAX; len *= 4) {
+		touch_heap(mapped, len);
+		mapped = len;
+		cow = fork_cycles(&parent, true);
+		eager = fork_cycles(&parent, false);
+
+		/* With a child around, every page that the parent writes gets copied */
+		if (cow == 0 || eager == 0 || proc_fork(&child, &parent, true) < 0) {
+			printf("Fork benchmark: out of memory\n");
+			break;
+		}
+		start = rdtsc();
+		touch_heap(0, len);
+		writes = (rdtsc() - start) / (len / PAGE_SIZE);
+		proc_destroy(&child);
+
+		printf("Fork, %llu MiB heap: %llu cycles copy-on-write, %llu eager copy; "
+			"%llu cycles per page written afterwards\n", len >> 20, cow, eager, writes);
+	}
+	proc_switch(init);
+out:
+	proc_destroy(&parent);
+}
+
+#define NUMA_BUFFER_ORDER	14	/* 64 MiB, well past the caches */
+#define NUMA_ROUNDS		4
+
+/* MB/s for 'bytes' moved in 'cycles', or bytes per kilocycle without a TSC rate */
+static uint64_t bandwidth(uint64_t bytes, uint64_t cycles)
+{
+	uint64_t khz = timeline_tsc_khz();
+
+	if (cycles == 0)
+		return 0;
+	/* bytes * kHz / cycles is bytes per ms */
+	return khz != 0 ? bytes * khz / cycles / 1000 : bytes * 1000 / cycles;
+}
+
+void bench_numa(void)
+{
+	uint64_t size = PAGE_SIZE << NUMA_BUFFER_ORDER, start, writes, reads, sum = 0;
+	unsigned int local = numa_local_node(), i, node;
+	volatile uint64_t sink;
+	uint64_t *buf, *p;
+	size_t round;
+
+	if (numa_nodes() < 2) {
+		printf("NUMA benchmark: one node only (run QEMU with NUMA=1)\n");
+		return;
+	}
+
+	/* The local node first, then the others by distance */
+	for (i = 0; i < numa_nodes(); i++) {
+		node = numa_fallback(local, i);
+		buf = alloc_pages_node(NUMA_BUFFER_ORDER, node);
+		if (buf == NULL || page_node(buf) != node) {
+			printf("NUMA node %u: no free %llu MiB block\n", node, size >> 20);
+			if (buf != NULL)
+				free_pages(buf, NUMA_BUFFER_ORDER);
+			continue;
+		}
+		/* The first pass warms up the TLB */
+		memset(buf, 0, size);
+
+		start = rdtsc();
+		for (round = 0; round < NUMA_ROUNDS; round++)
+			memset(buf, (int) round, size);
+		writes = rdtsc() - start;
+
+		start = rdtsc();
+		for (round = 0; round < NUMA_ROUNDS; round++) {
+			for (p = buf; p < buf + size / sizeof(*p); p++)
+				sum += *p;
+		}
+		reads = rdtsc() - start;
+		free_pages(buf, NUMA_BUFFER_ORDER);
+
+		printf("NUMA node %u (distance %u%s): write %llu, read %llu %s\n", node,
+			numa_distance(local, node), node == local ? ", local" : "",
+			bandwidth(size * NUMA_ROUNDS, writes), bandwidth(size * NUMA_ROUNDS, reads),
+			timeline_tsc_khz() != 0 ? "MB/s" : "bytes/kcycle");
+	}
+	sink = sum;
+	(void) sink;
+}
+
+void bench_run(void)
+{
+	bench_switch();
+	bench_vma();
+	bench_fork();
+	bench_numa();
+}
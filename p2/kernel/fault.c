@@ -0,0 +1,106 @@
+/*
+ * fault.c - demand-zero paging of user regions, copy-on-write after fork()
+ */
+
+#include <fault.h>
+#include <cpu.h>
+#include <paging.h>
+#include <page_alloc.h>
+#include <printf.h>
+#include <string.h>
+#include <vm.h>
+
+static unsigned int log2_floor(uint64_t v)
+{
+	unsigned int i = 0;
+	while (v >>= 1)
+		i++;
+	return i;
+}
+
+/* A write to a shared page: the last sharer takes the frame over, the others get a copy */
+static bool cow_fault(struct process *p, uint64_t addr)
+{
+	uint64_t va = addr & ~(PAGE_SIZE - 1);
+	uint64_t entry = vm_lookup(p->pml4, va, NULL);
+	void *frame = (void *) (entry & PTE_ADDR_MASK), *page;
+	const struct vma *r = proc_find_region(p, addr);
+
+	if (!(entry & PTE_COW) || r == NULL || !(r->flags & PTE_W))
+		return false;
+	p->cow_faults++;
+	if (page_refs(frame) == 1)
+		return vm_map_range(p->pml4, va, (uint64_t) frame, PAGE_SIZE, r->flags) == 0;
+
+	page = alloc_page();
+	if (page == NULL) {
+		printf("ERROR: out of memory for a page fault at %p\n", (void *) addr);
+		return false;
+	}
+	memcpy(page, frame, PAGE_SIZE);
+	if (vm_map_range(p->pml4, va, (uint64_t) page, PAGE_SIZE, r->flags) < 0) {
+		free_page(page);
+		return false;
+	}
+	page_put(frame);
+	p->cow_copies++;
+	return true;
+}
+
+bool fault_handle(struct trap_frame *tf)
+{
+	uint64_t start = rdtsc();
+	uint64_t addr = read_cr2();
+	struct process *p = current_process;
+	const struct vma *r;
+	unsigned int bucket;
+	void *page;
+
+	if (p == NULL)
+		return false;
+	/* Protection violations are real errors unless the page is copy-on-write */
+	if (tf->error & PF_P)
+		return (tf->error & PF_W) && cow_fault(p, addr);
+	r = proc_find_region(p, addr);
+	if (r == NULL || !(r->flags & PTE_U) || ((tf->error & PF_W) && !(r->flags & PTE_W)))
+		return false;
+
+	page = alloc_zeroed_page();
+	if (page == NULL) {
+		printf("ERROR: out of memory for a page fault at %p\n", (void *) addr);
+		return false;
+	}
+	/* A not-present entry is never cached in the TLB, no flush is needed */
+	if (vm_map_range(p->pml4, addr & ~(PAGE_SIZE - 1), (uint64_t) page, PAGE_SIZE,
+			 r->flags) < 0) {
+		free_page(page);
+		return false;
+	}
+
+	bucket = log2_floor(rdtsc() - start);
+	if (bucket >= FAULT_HIST_BUCKETS)
+		bucket = FAULT_HIST_BUCKETS - 1;
+	p->fault_hist[bucket]++;
+	p->faults++;
+
+	/* The page is in place, refill outside the measured fault time */
+	page_zero_top_up();
+	return true;
+}
+
+void fault_dump(const struct process *p)
+{
+	struct page_alloc_stats stats;
+	size_t i;
+
+	printf("Page faults: %zu demand-zero, %zu KiB mapped\n", p->faults,
+		p->faults * (size_t) (PAGE_SIZE / 1024));
+	if (p->cow_faults != 0)
+		printf("Copy-on-write faults: %zu, %zu copied\n", p->cow_faults, p->cow_copies);
+	page_alloc_stats(&stats);
+	printf("Zeroed-frame pool: %zu hits, %zu misses\n", stats.zero_hits, stats.zero_misses);
+	for (i = 0; i < FAULT_HIST_BUCKETS; i++) {
+		if (p->fault_hist[i] != 0)
+			printf("  %10llu+ cycles: %zu\n", 1ULL << i, p->fault_hist[i]);
+	}
+}
@@ -16,6 +16,9 @@ extern unsigned char __ascii_font[2048]; /* ascii_font.c */
 static unsigned int *Fb;
 static unsigned int Width, PosX, PosY, MaxX, MaxY;
 
+/* The 8 pixels of each font bitmap byte, built by fb_init() */
+static unsigned int Expand[256][FONT_WIDTH];
+
 #define HELLO_STATEMENT \
 	"MiniOS Framebuffer Console (CMPSC 473)\nCopyright (C) 2023 Ruslan Nikolaev\n\n"
 
@@ -29,6 +32,12 @@ void fb_init(unsigned int *fb, unsigned int width, unsigned int height)
 		fb[i] = 0x00000000U;
 	}
 
+	for (i = 0; i < 256; i++) {
+		size_t j;
+		for (j = 0; j < FONT_WIDTH; j++)
+			Expand[i][j] = (i << j) & 0x80 ? 0xFFFFFFFFU : 0x00000000U;
+	}
+
 	Fb = fb;
 	Width = width;
 	PosX = 0;
@@ -42,27 +51,41 @@ void fb_init(unsigned int *fb, unsigned int width, unsigned int height)
 	}
 }
 
-static void fb_scrollup(void)
+static void fb_scrollup(size_t rows)
 {
-	/* Move the text up one row */
-	size_t cur = 0, count = Width * ((MaxY - 1) * FONT_HEIGHT);
-	size_t row = Width * FONT_HEIGHT;
-	do {
+	/* Move the text up 'rows' rows (1 .. MaxY) */
+	size_t cur = 0, count = Width * ((MaxY - rows) * FONT_HEIGHT);
+	size_t row = Width * FONT_HEIGHT * rows;
+	while (count != 0) {
 		Fb[cur] = Fb[cur+row];
 		cur++;
-	} while (--count != 0);
+		count--;
+	}
 
-	/* Clean up the last row */
+	/* Clean up the last rows */
 	do {
 		Fb[cur] = 0x00000000U;
 		cur++;
 	} while (--row != 0);
 }
 
+/* Draws 'ch' (printable ASCII) at text position (x, y) */
+static void fb_glyph(char ch, size_t x, size_t y)
+{
+	const unsigned char *ptr = &__ascii_font[(unsigned char) ch * (FONT_WIDTH * FONT_HEIGHT / 8)];
+	unsigned int *dst = &Fb[x * FONT_WIDTH + y * FONT_HEIGHT * Width];
+	size_t j, i;
+
+	for (j = 0; j < FONT_HEIGHT; j++) {
+		const unsigned int *pixels = Expand[ptr[j]];
+		for (i = 0; i < FONT_WIDTH; i++)
+			dst[i] = pixels[i];
+		dst += Width;
+	}
+}
+
 void fb_output(char ch)
 {
-	size_t cur;
-	unsigned char *ptr;
 	if ((signed char) ch <= 0) { /* not in the ASCII subset */
 		if (ch == 0) return;
 		ch = '?'; /* an unknown character */
@@ -73,23 +96,61 @@ void fb_output(char ch)
 	}
 	if (PosY == MaxY) {
 		PosY--;
-		fb_scrollup();
+		fb_scrollup(1);
 	}
 	if (ch == '\n')
 		return;
-	ptr = &__ascii_font[(unsigned char) ch * (FONT_WIDTH * FONT_HEIGHT / 8)];
-	cur = (size_t) PosX * FONT_WIDTH + (PosY * FONT_HEIGHT) * Width;
-	size_t j;
-	for (j = 0; j < FONT_HEIGHT; j++) {
-		/* for simplicity, assume that FONT_WIDTH=8, i.e., fits in one byte */
-		signed char bitmap = ptr[j];
-		size_t i;
-		for (i = 0; i < FONT_WIDTH; i++) {
-			signed char color = (bitmap >> 7); /* propagate the sign bit */
-			Fb[cur + i] = (signed int) color; /* sign extend to 32 bits */
-			bitmap <<= 1;
+	fb_glyph(ch, PosX, PosY);
+	PosX++;
+}
+
+/*
+ * The same as fb_output() for each character, but the screen scrolls
+ * once for the whole buffer, and lines that would scroll off before the
+ * end are never drawn
+ */
+void fb_write(const char *buf, size_t len)
+{
+	size_t i, lines = 0, scroll, x;
+	long y;
+
+	/* The line breaks that the text causes, explicit or wrapped */
+	x = PosX;
+	for (i = 0; i < len; i++) {
+		char ch = buf[i];
+		if (ch == 0)
+			continue;
+		if (ch == '\n' || x == MaxX) {
+			lines++;
+			x = 0;
 		}
-		cur += Width;
+		if (ch != '\n')
+			x++;
 	}
-	PosX++;
+	scroll = PosY + lines >= MaxY ? PosY + lines - (MaxY - 1) : 0;
+	if (scroll != 0)
+		fb_scrollup(scroll < MaxY ? scroll : MaxY);
+
+	/* Line k of the text lands on row PosY + k - scroll, rows above 0 are gone */
+	y = (long) PosY - (long) scroll;
+	x = PosX;
+	for (i = 0; i < len; i++) {
+		char ch = buf[i];
+		if ((signed char) ch <= 0) { /* not in the ASCII subset */
+			if (ch == 0)
+				continue;
+			ch = '?';
+		}
+		if (ch == '\n' || x == MaxX) {
+			x = 0;
+			y++;
+		}
+		if (ch == '\n')
+			continue;
+		if (y >= 0)
+			fb_glyph(ch, x, y);
+		x++;
+	}
+	PosX = x;
+	PosY = PosY + lines - scroll;
 }
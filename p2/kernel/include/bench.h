@@ -0,0 +1,30 @@
+#pragma once
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Boot-time microbenchmarks (make BENCH=1), run at the end of
+ * kernel_init() with the init process loaded; user/user.c has the
+ * user-space ones
+ */
+void bench_run(void);
+
+/* Address-space switches with and without PCIDs */
+void bench_switch(void);
+
+/* A stress test of the VMA tree with tens of thousands of areas */
+void bench_vma(void);
+
+/* fork() of a process with a large heap: copy-on-write vs. an eager copy */
+void bench_fork(void);
+
+/* Memory bandwidth of this CPU to the frames of each NUMA node */
+void bench_numa(void);
+
+#ifdef __cplusplus
+}
+#endif
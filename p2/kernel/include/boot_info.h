@@ -0,0 +1,96 @@
+#pragma once
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The loader-to-kernel handoff; must match boot_info_t in Code/boot/boot.c.
+ * Only fixed-size fields: the loader is built with a 32-bit 'long'.
+ * New fields go to the end and bump BOOT_INFO_VERSION.
+ */
+#define BOOT_INFO_MAGIC		0x4F464E49544F4F42ULL /* "BOOTINFO" */
+#define BOOT_INFO_VERSION	3
+
+#define BOOT_MODULES_MAX	8
+#define BOOT_MODULE_NAME_MAX	16
+#define BOOT_MARKS_MAX		16
+#define BOOT_MARK_NAME_MAX	24
+
+typedef struct boot_module_s {
+	uint64_t base;		/* physical address of the loaded image */
+	uint64_t size;		/* bytes */
+	uint64_t entry;		/* physical entry point, 0 if none */
+	char name[BOOT_MODULE_NAME_MAX];
+} boot_module_t;
+
+typedef struct boot_mark_s {
+	uint64_t tsc;		/* when the phase ended */
+	char name[BOOT_MARK_NAME_MAX];
+} boot_mark_t;
+
+typedef struct boot_info_s {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t size;		/* sizeof(boot_info_t) in the loader */
+
+	/* The final UEFI memory map (after ExitBootServices) */
+	uint64_t memory_map;	/* EFI_MEMORY_DESCRIPTOR array */
+	uint64_t memory_map_size;
+	uint64_t memory_desc_size;
+	uint32_t memory_desc_version;
+	uint32_t reserved0;
+
+	/* GOP framebuffer */
+	uint64_t fb_base;
+	uint64_t fb_size;
+	uint32_t fb_width;
+	uint32_t fb_height;
+	uint32_t fb_stride;	/* pixels per scan line */
+	uint32_t fb_format;	/* EFI_GRAPHICS_PIXEL_FORMAT */
+
+	uint64_t rsdp;		/* ACPI RSDP, 0 if not found */
+
+	/* Early kernel memory: the heap followed by the first frame-allocator zone */
+	uint64_t memory;
+	uint64_t memory_size;
+
+	uint32_t module_count;
+	uint32_t reserved1;
+	boot_module_t modules[BOOT_MODULES_MAX];
+
+	/* Boot timeline (version 2) */
+	uint64_t tsc_khz;	/* TSC ticks per millisecond */
+	uint32_t mark_count;
+	uint32_t map_retries;	/* extra GetMemoryMap/ExitBootServices rounds */
+	boot_mark_t marks[BOOT_MARKS_MAX];
+
+	/*
+	 * Kernel page tables built by the loader (version 3), cr3 is 0 unless
+	 * the loader is built with BOOT_PT=1: an identity map in PML4[0],
+	 * aliased at 0xFFFF800000000000, large pages above the first 2 MiB
+	 */
+	uint64_t cr3;
+	uint64_t page_tables_size;	/* bytes */
+	uint64_t identity_map_size;	/* bytes, a multiple of 1 GiB */
+} boot_info_t;
+
+/* The subset of EFI_MEMORY_DESCRIPTOR that the kernel needs */
+typedef struct efi_memory_descriptor_s {
+	uint32_t type;
+	uint32_t pad;
+	uint64_t phys_start;
+	uint64_t virt_start;
+	uint64_t pages;		/* 4 KiB pages */
+	uint64_t attribute;
+} efi_memory_descriptor_t;
+
+#define EFI_CONVENTIONAL_MEMORY	7
+
+const boot_module_t *boot_find_module(const boot_info_t *bi, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
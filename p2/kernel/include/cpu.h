@@ -0,0 +1,102 @@
+#pragma once
+
+#include <types.h>
+
+/* CPUID feature bits */
+#define CPUID_1_ECX_PCID		(1U << 17)
+#define CPUID_80000001_EDX_NX		(1U << 20)
+#define CPUID_80000001_EDX_PAGE1GB	(1U << 26)
+
+/* Control register bits */
+#define CR0_WP		(1ULL << 16)	/* read-only pages bind the kernel too */
+#define CR3_PCID_MASK	0xFFFULL
+#define CR3_NOFLUSH	(1ULL << 63)	/* keep the new PCID's TLB entries */
+#define CR4_PGE		(1ULL << 7)
+#define CR4_PCIDE	(1ULL << 17)
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax,
+			 uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+	__asm__ __volatile__ ("cpuid"
+		: "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+		: "a" (leaf), "c" (subleaf)
+	);
+}
+
+static inline uint32_t cpuid_max_extended(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+	return eax;
+}
+
+/* The (x2)APIC ID of this CPU, the x2APIC one if the CPU has leaf 0xB */
+static inline uint32_t cpu_apic_id(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+	if (eax >= 0xB) {
+		cpuid(0xB, 0, &eax, &ebx, &ecx, &edx);
+		if (ebx != 0)
+			return edx;
+	}
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	return ebx >> 24;
+}
+
+static inline uint64_t rdtsc(void)
+{
+	uint32_t low, high;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+	return ((uint64_t) high << 32) | low;
+}
+
+static inline uint64_t read_cr0(void)
+{
+	uint64_t val;
+	__asm__ __volatile__ ("movq %%cr0, %0" : "=r" (val));
+	return val;
+}
+
+static inline void write_cr0(uint64_t val)
+{
+	__asm__ __volatile__ ("movq %0, %%cr0" : : "r" (val) : "memory");
+}
+
+static inline uint64_t read_cr2(void)
+{
+	uint64_t val;
+	__asm__ __volatile__ ("movq %%cr2, %0" : "=r" (val));
+	return val;
+}
+
+static inline uint64_t read_cr3(void)
+{
+	uint64_t val;
+	__asm__ __volatile__ ("movq %%cr3, %0" : "=r" (val));
+	return val;
+}
+
+static inline void write_cr3(uint64_t val)
+{
+	__asm__ __volatile__ ("movq %0, %%cr3" : : "r" (val) : "memory");
+}
+
+static inline uint64_t read_cr4(void)
+{
+	uint64_t val;
+	__asm__ __volatile__ ("movq %%cr4, %0" : "=r" (val));
+	return val;
+}
+
+static inline void write_cr4(uint64_t val)
+{
+	__asm__ __volatile__ ("movq %0, %%cr4" : : "r" (val) : "memory");
+}
+
+static inline void invlpg(uint64_t va)
+{
+	__asm__ __volatile__ ("invlpg (%0)" : : "r" (va) : "memory");
+}
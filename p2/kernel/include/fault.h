@@ -0,0 +1,28 @@
+#pragma once
+
+#include <types.h>
+#include <trap.h>
+#include <proc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* #PF error code bits */
+#define PF_P	0x01	/* protection violation (the page was present) */
+#define PF_W	0x02	/* write access */
+#define PF_U	0x04	/* user mode */
+
+/*
+ * Maps a zeroed page for a not-present fault inside one of
+ * current_process's regions, or a private copy for a write to a shared
+ * copy-on-write page; false if the fault is not ours to fix
+ */
+bool fault_handle(struct trap_frame *tf);
+
+/* Prints the fault counter and the latency histogram of 'p' */
+void fault_dump(const struct process *p);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -7,6 +9,9 @@ extern "C" {
 void fb_init(unsigned int *fb, unsigned int width, unsigned int height);
 void fb_output(char ch);
 
+/* 'len' bytes as fb_output() would print them, much faster */
+void fb_write(const char *buf, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
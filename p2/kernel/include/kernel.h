@@ -1,6 +1,7 @@
 #pragma once
 
 #include <types.h>
+#include <boot_info.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -8,7 +9,7 @@ extern "C" {
 
 extern void *kernel_stack; /* the kernel stack */
 extern void *user_stack; /* the user stack */
-extern void *user_program; /* the user program */
+extern void *user_program; /* the user program's entry point */
 void user_jump(void * addr); /* an initial jump to user mode, addr is a VIRTUAL address of user's _start */
 
 /*
@@ -22,12 +23,27 @@ extern void *syscall_entry_ptr;
 /* the system call handler */
 long syscall_entry(long n, long a1, long a2, long a3, long a4, long a5);
 
-/* kernel initialization */
-void kernel_init(void *ustack, void *uprogram, void *memory, size_t memorySize);
+/*
+ * kernel initialization, page tables and the user stack come from alloc_pages();
+ * physical memory below 'phys_top' gets identity-mapped unless the loader
+ * has already built the kernel page tables (bi->cr3)
+ */
+void kernel_init(const boot_info_t *bi, const boot_module_t *uprogram, uint64_t phys_top);
+
+/*
+ * Where the kernel stops for good once nothing can run (no runnable
+ * process is left): fills the zeroed-frame pool one last time, then halts
+ * with interrupts masked. It is not a background idle loop, see
+ * page_zero_top_up() for the refills while processes run.
+ */
+void kernel_idle(void);
 
 /* check and load page table */
 const char *load_page_table(void *page_table);
 
+/* 1: page table is loaded, 2: user space is also mapped */
+extern long kernel_status;
+
 typedef struct framebuffer_s {
 	uint32_t *addr;
 	uint32_t width;
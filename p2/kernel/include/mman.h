@@ -0,0 +1,40 @@
+#pragma once
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Must match user/include/mman.h */
+#define PROT_NONE	0x0
+#define PROT_READ	0x1
+#define PROT_WRITE	0x2
+#define PROT_EXEC	0x4
+
+#define MAP_PRIVATE	0x02
+#define MAP_FIXED	0x10
+#define MAP_ANONYMOUS	0x20
+#define MAP_POPULATE	0x8000	/* allocate (large pages if possible) up front */
+
+#define MAP_FAILED	(-1L)
+
+/*
+ * Anonymous memory for current_process, backed by the frame allocator.
+ * Mappings go to [USER_MMAP_BASE, USER_MMAP_END), aligned to the largest
+ * page size that their length allows. Without MAP_POPULATE their pages are
+ * zero-filled on first touch.
+ */
+long sys_mmap(uint64_t addr, uint64_t len, long prot, long flags, long fd);
+long sys_munmap(uint64_t addr, uint64_t len);
+long sys_mprotect(uint64_t addr, uint64_t len, long prot);
+
+/* Moves the end of the heap; returns the new end, or the old one on failure */
+long sys_brk(uint64_t addr);
+
+/* Registers the calls above with the system call table */
+void mman_init(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -7,6 +7,8 @@
 #define MSR_LSTAR	0xC0000082
 #define MSR_SFMASK	0xC0000084
 
+#define EFER_NXE	(1ULL << 11)	/* PTE_NX is valid */
+
 /* GDT entries, do not re-arrange those! */
 #define GDT_KERNEL_CODE	0x08
 #define GDT_KERNEL_DATA	0x10
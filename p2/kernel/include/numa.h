@@ -0,0 +1,43 @@
+#pragma once
+
+#include <types.h>
+#include <boot_info.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The NUMA topology from the ACPI SRAT (which memory and CPUs belong to
+ * which proximity domain) and SLIT (the distances between them). Domains
+ * are numbered 0 .. numa_nodes() - 1 in the order the SRAT lists them.
+ * Without the tables everything is node 0.
+ */
+#define NUMA_NODES_MAX		8
+#define NUMA_LOCAL_DISTANCE	10	/* the SLIT value of a node to itself */
+#define NUMA_REMOTE_DISTANCE	20	/* assumed when the SLIT is missing */
+
+/* Reads the SRAT and SLIT through bi->rsdp; before any memory is added */
+void numa_init(const boot_info_t *bi);
+
+unsigned int numa_nodes(void);
+
+/* The node of the CPU that runs the kernel */
+unsigned int numa_local_node(void);
+
+/*
+ * The node of physical address 'pa'; '*end' is set to the end of the
+ * range that shares it (callers split memory ranges there)
+ */
+unsigned int numa_memory_node(uint64_t pa, uint64_t *end);
+
+unsigned int numa_distance(unsigned int from, unsigned int to);
+
+/* The i-th closest node to 'node' (i = 0 is 'node' itself), by distance */
+unsigned int numa_fallback(unsigned int node, unsigned int i);
+
+void numa_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <types.h>
+#include <numa.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Orders 0..PAGE_MAX_ORDER, i.e., blocks of 4 KiB .. 1 GiB */
+#define PAGE_MAX_ORDER	18
+#define PAGE_ORDERS	(PAGE_MAX_ORDER + 1)
+
+struct page_alloc_stats {
+	size_t total_frames;		/* frames managed by the allocator */
+	size_t free_frames;		/* frames currently free */
+	size_t free_blocks[PAGE_ORDERS];	/* free blocks per order */
+	size_t allocs;			/* successful alloc_pages() calls */
+	size_t frees;			/* free_pages() calls */
+	size_t failures;		/* failed alloc_pages() calls */
+	size_t remote_allocs;		/* served by another node than asked for */
+	size_t node_free[NUMA_NODES_MAX];	/* free frames per NUMA node */
+	size_t zero_pool;		/* pre-zeroed frames ready */
+	size_t zero_hits;		/* alloc_zeroed_page() calls served by the pool */
+	size_t zero_misses;		/* ... that had to zero a frame on the spot */
+};
+
+/*
+ * hand [start, start + size) over to the allocator (1:1 mapped), after
+ * numa_init() so that each frame lands on its node
+ */
+void page_alloc_add_range(void *start, size_t size);
+
+/* 2^order contiguous, naturally aligned frames; NULL if none are left */
+void *alloc_pages(unsigned int order);
+
+/*
+ * Gives a block back; a block whose first frame is already free (on its
+ * own or inside a larger free block) is reported and left alone
+ */
+void free_pages(void *addr, unsigned int order);
+
+/*
+ * The same from 'node', or from the other nodes in distance order
+ * (numa_fallback()) when it has none; alloc_pages() asks for the node
+ * of the running CPU
+ */
+void *alloc_pages_node(unsigned int order, unsigned int node);
+
+/* The node that a frame belongs to */
+unsigned int page_node(void *addr);
+
+/* The order of a block of 'size' bytes (a power of two) */
+static inline unsigned int page_order(uint64_t size)
+{
+	unsigned int order = 0;
+	while ((4096ULL << order) < size)
+		order++;
+	return order;
+}
+
+static inline void *alloc_page(void) { return alloc_pages(0); }
+static inline void free_page(void *addr) { free_pages(addr, 0); }
+
+/*
+ * A zero-filled frame, from a pool of frames that are zeroed ahead of
+ * time (with non-temporal stores, bypassing the caches); frames are
+ * zeroed on the spot when the pool is empty. The kernel has no idle
+ * thread, so the pool is filled at the end of kernel_init() and topped
+ * up off the critical path: after a system call or a page fault has been
+ * served (page_zero_top_up()) and when a process blocks in wait(). The
+ * pool goes back to the allocator when it runs out of memory.
+ */
+#define ZERO_POOL_MAX	512
+#define ZERO_POOL_LOW	128	/* page_zero_top_up() refills below this */
+#define ZERO_REFILL_BATCH	32	/* frames zeroed per top-up, keeps the delay bounded */
+
+void *alloc_zeroed_page(void);
+
+/* A batch of ZERO_REFILL_BATCH frames if the pool is below ZERO_POOL_LOW */
+void page_zero_top_up(void);
+
+/* Zeroes up to 'max' frames for the pool; the number added */
+size_t page_zero_refill(size_t max);
+
+/*
+ * Frames shared by several mappings (copy-on-write): an allocated 4 KiB
+ * frame starts with one reference. page_get() fails for frames that the
+ * allocator does not manage or that have too many references already;
+ * page_put() frees the frame with its last reference and leaves unmanaged
+ * frames alone. page_refs() is 0 for those.
+ */
+bool page_get(void *addr);
+void page_put(void *addr);
+unsigned int page_refs(void *addr);
+
+/* the end of the highest range handed over so far */
+uint64_t page_alloc_top(void);
+
+void page_alloc_stats(struct page_alloc_stats *stats);
+void page_alloc_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
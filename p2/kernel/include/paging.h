@@ -0,0 +1,33 @@
+#pragma once
+
+#include <types.h>
+
+#define PAGE_SIZE	4096ULL
+#define PAGE_SIZE_2M	(1ULL << 21)
+#define PAGE_SIZE_1G	(1ULL << 30)
+#define PT_ENTRIES	512
+
+/* Page-table entry bits */
+#define PTE_P		0x001ULL	/* present */
+#define PTE_W		0x002ULL	/* writable */
+#define PTE_U		0x004ULL	/* user-accessible */
+#define PTE_PS		0x080ULL	/* 2 MiB (PDE) or 1 GiB (PDPTE) page */
+#define PTE_G		0x100ULL	/* global: survives CR3 loads (CR4.PGE) */
+#define PTE_COW		0x400ULL	/* software: a shared, copy-on-write page */
+#define PTE_NX		0x8000000000000000ULL	/* no-execute, see vm_nx_init() */
+#define PTE_ADDR_MASK	0x000FFFFFFFFFF000ULL
+
+/* The kernel identity map lives in PML4[0] */
+#ifdef KERNEL_PT_4K
+# define IDENTITY_MAP_MAX	(4ULL << 30)	/* the layout load_page_table() checks */
+#else
+# define IDENTITY_MAP_MAX	(512ULL << 30)
+#endif
+
+/*
+ * The higher-half alias of the identity map, PML4[256] shares its PDPT.
+ * Only an alias: the kernel is linked, loaded and run at its physical
+ * (identity-mapped) addresses, and the low half stays mapped.
+ */
+#define DIRECT_MAP_BASE		0xFFFF800000000000ULL
+#define DIRECT_MAP_PML4		256
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Process-context identifiers tag TLB entries with an address space, so
+ * that CR3 writes with CR3_NOFLUSH keep them. PCID 0 is the untagged
+ * default and is never handed out.
+ */
+#define PCID_MAX	64	/* the pool: PCIDs 1 .. PCID_MAX - 1 */
+
+/* Sets CR4.PCIDE if the CPU has PCIDs; CR3 must have PCID 0 loaded */
+void pcid_init(void);
+bool pcid_enabled(void);
+
+/* 0 when PCIDs are off or all are taken, the caller runs untagged then */
+uint16_t pcid_alloc(void);
+void pcid_free(uint16_t pcid);
+
+#ifdef __cplusplus
+}
+#endif
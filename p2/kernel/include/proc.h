@@ -0,0 +1,115 @@
+#pragma once
+
+#include <types.h>
+#include <vma.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Fault latency histogram buckets: [2^i, 2^(i+1)) cycles */
+#define FAULT_HIST_BUCKETS	32
+
+/* Process states, see sched.c */
+#define PROC_RUNNABLE	1
+#define PROC_WAITING	2	/* in wait() for a child */
+#define PROC_ZOMBIE	3	/* exited, not waited for yet */
+
+struct process {
+	uint64_t *pml4;
+	uint16_t pcid;		/* 0: untagged, every switch flushes the TLB */
+	bool tlb_stale;		/* the next switch must flush this PCID */
+	/*
+	 * User regions: their pages are allocated and zero-filled on first
+	 * touch (or up front, see MAP_POPULATE) and belong to the process
+	 * alone, or are shared copy-on-write after fork()
+	 */
+	struct vma_tree vmas;
+	uint64_t brk;		/* the end of the heap, see sys_brk() */
+
+	/* Demand-zero page faults and their handling time in cycles */
+	size_t faults;
+	size_t fault_hist[FAULT_HIST_BUCKETS];
+	size_t cow_faults;	/* writes to shared pages */
+	size_t cow_copies;	/* ... that had to copy the frame */
+
+	/* Scheduling, see sched.c */
+	int pid;
+	int state;		/* PROC_* */
+	long exit_code;
+	struct process *parent;
+	struct process *next;	/* all processes, the init process first */
+	void *kstack;		/* its own kernel stack block, NULL for the boot stack */
+	void *kstack_top;
+	uint64_t ksp;		/* the kernel stack pointer while switched out */
+	void *ustack;		/* user_stack while switched out */
+
+	/* The rings at USER_RING_VA, see ring.c; no rings while ring_entries is 0 */
+	uint32_t ring_entries;
+	uint32_t ring_flags;
+	uint32_t ring_sq_head;	/* the kernel's own indices, user space */
+	uint32_t ring_cq_tail;	/* may scribble over the header */
+};
+
+/* The process whose page tables are loaded */
+extern struct process *current_process;
+
+/* The kernel page tables, every address space shares all but USER_PML4 */
+extern uint64_t *kernel_pml4;
+
+/* Sets up 'p' on existing page tables */
+void proc_init(struct process *p, uint64_t *pml4);
+
+/*
+ * A new address space with the kernel half of kernel_pml4 and the kernel
+ * data page (vdso.h) in its user half; 0 or -1
+ */
+int proc_create(struct process *p);
+
+/*
+ * Frees the user page tables, the frames mapped in the regions and the
+ * PCID; 'p' must not be current_process
+ */
+void proc_destroy(struct process *p);
+
+/*
+ * A copy of the user half of 'parent' in a new address space 'child': its
+ * regions, the heap break, and the pages, shared copy-on-write or (with
+ * !cow, a baseline for benchmarks) copied eagerly; 0 or -1
+ */
+int proc_fork(struct process *child, struct process *parent, bool cow);
+
+/* Load the page tables of 'p', keeping its TLB entries if it has a PCID */
+void proc_switch(struct process *p);
+
+/*
+ * Regions: ranges are page-aligned [start, start + len) without wrap-around,
+ * the functions return 0 or -1 (bad arguments or out of memory). Adjacent
+ * regions with the same flags are merged.
+ */
+
+/* A new region that must not overlap the others */
+int proc_add_region(struct process *p, uint64_t start, uint64_t len, uint64_t flags);
+
+/* The region containing 'addr', NULL if none */
+struct vma *proc_find_region(struct process *p, uint64_t addr);
+
+/* Whether regions with all of 'flags' cover [start, start + len), any alignment */
+bool proc_check_range(struct process *p, uint64_t start, uint64_t len, uint64_t flags);
+
+/* Drops the range from the regions, splitting those that stick out */
+int proc_remove_regions(struct process *p, uint64_t start, uint64_t len);
+
+/* Sets the flags of a range that the regions fully cover */
+int proc_protect_regions(struct process *p, uint64_t start, uint64_t len, uint64_t flags);
+
+/* The lowest 'align'-aligned free range of 'len' bytes in [lo, hi), 0 if none */
+uint64_t proc_find_gap(const struct process *p, uint64_t lo, uint64_t hi,
+		       uint64_t len, uint64_t align);
+
+/* Unmaps the range and frees the frames behind it */
+void proc_release(struct process *p, uint64_t start, uint64_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <types.h>
+#include <proc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Submission/completion rings shared with user space, after io_uring:
+ * the process queues system calls (number and arguments) in the
+ * submission ring and makes one SYS_RING_ENTER for the whole batch; the
+ * results come back in the completion ring, tagged with user_data.
+ * The layout must match user/include/ring.h.
+ *
+ * At USER_RING_VA: the header page, sq_entries SQEs, then 2 * sq_entries
+ * CQEs. User space writes sq_tail and cq_head, the kernel sq_head and
+ * cq_tail; indices run freely and wrap through the masks.
+ */
+#define RING_ENTRIES_MAX	4096	/* a power of two */
+
+/*
+ * The kernel also drains the submission ring on every other system call
+ * of the process: there is no kernel thread to poll it (nor interrupts),
+ * so this is as close to io_uring's SQPOLL as this kernel gets
+ */
+#define RING_POLL		0x1
+
+struct ring_header {
+	uint32_t sq_head;
+	uint32_t sq_tail;
+	uint32_t cq_head;
+	uint32_t cq_tail;
+	uint32_t sq_entries;
+	uint32_t cq_entries;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+struct ring_sqe {
+	uint64_t nr;		/* SYS_*, not fork, exit, wait or the ring calls */
+	uint64_t args[5];
+	uint64_t user_data;	/* copied to the CQE */
+	uint64_t reserved;
+};
+
+struct ring_cqe {
+	uint64_t user_data;
+	int64_t result;		/* -1 for calls that cannot be queued */
+};
+
+#define RING_SQES_OFFSET	4096
+#define RING_CQES_OFFSET(sq_entries)	(RING_SQES_OFFSET + (sq_entries) * sizeof(struct ring_sqe))
+#define RING_SIZE(sq_entries)	(RING_CQES_OFFSET(sq_entries) + \
+				 2 * (sq_entries) * sizeof(struct ring_cqe))
+
+/* Registers SYS_RING_SETUP and SYS_RING_ENTER */
+void ring_init(void);
+
+/* What RING_POLL does: runs the queued calls of 'p' (current_process) */
+void ring_poll(struct process *p);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <types.h>
+#include <proc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The init process heads the process list, it runs on the boot kernel stack;
+ * also registers fork(), exit() and wait() with the system call table
+ */
+void sched_init(struct process *init);
+
+/*
+ * fork(): 'frame' is the system-call frame of syscall_entry_asm with the
+ * callee-saved registers on top (see kernel_asm.S); the child's pid, or -1.
+ * The child returns 0 from the same system call once it gets to run.
+ */
+long sys_fork(const uint64_t *frame);
+
+/* Ends the current process and runs another one, never returns */
+void sys_exit(long code);
+
+/*
+ * Waits for the child 'pid' (-1: any child) to exit and frees it; its exit
+ * code & 0xFF, or -1 if there is no such child
+ */
+long sys_wait(long pid);
+
+/* kernel_asm.S: saves the kernel stack pointer to 'save', continues on 'rsp' */
+void context_switch(uint64_t *save, uint64_t rsp);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <types.h>
+#include <syscall_nr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Numbers 0 .. SYSCALL_MAX - 1 have a slot in the table */
+#define SYSCALL_MAX	(SYS_FAST_LAST + 1)
+
+typedef long (*syscall_handler_t)(long a1, long a2, long a3, long a4, long a5);
+
+/*
+ * A slot of the system call table. The cycles of a call that blocks
+ * (wait) include the time that other processes ran in the meantime.
+ * Leaf calls (SYS_FAST_FIRST ..) only get here through the rings, their
+ * direct calls never leave kernel_asm.S and are not counted.
+ */
+struct syscall_slot {
+	syscall_handler_t handler;
+	const char *name;
+	uint64_t calls;
+	uint64_t cycles;	/* TSC cycles, total */
+	uint64_t max_cycles;
+};
+
+/*
+ * Each subsystem registers its calls at boot; a NULL handler names a call
+ * that kernel_asm.S handles itself (fork), which still gets counted
+ */
+void syscall_register(long nr, const char *name, syscall_handler_t handler);
+
+/* Registers SYS_SYSCALL_STATS and SYS_NOP, before the other subsystems register theirs */
+void syscall_table_init(void);
+
+/* Runs system call 'n' as syscall_entry() does, -1 if there is no such call */
+long syscall_call(long n, long a1, long a2, long a3, long a4, long a5);
+
+/* fork() from kernel_asm.S, sys_fork() with the accounting of the table */
+long syscall_fork(const uint64_t *frame);
+
+/* Prints the counters of every call made so far, reset != 0 clears them */
+void syscall_stats_dump(bool reset);
+
+#ifdef __cplusplus
+}
+#endif
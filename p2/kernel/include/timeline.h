@@ -0,0 +1,25 @@
+#pragma once
+
+#include <types.h>
+#include <boot_info.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The boot phase timeline: the loader's marks followed by the kernel's.
+ * Each mark records the TSC when the phase named after it ended.
+ */
+void timeline_init(const boot_info_t *bi);
+void timeline_mark(const char *name);
+
+/* Prints the timeline once; later marks and calls are ignored */
+void timeline_print(void);
+
+/* TSC ticks per millisecond as the loader measured them, 0 if unknown */
+uint64_t timeline_tsc_khz(void);
+
+#ifdef __cplusplus
+}
+#endif
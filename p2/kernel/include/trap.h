@@ -0,0 +1,42 @@
+#pragma once
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Exception vectors that the kernel handles. Those that can hit the first
+ * instructions of a system call, which still run on the user stack
+ * (kernel_asm.S), get stacks of their own (IST2..IST4) like a double fault.
+ */
+#define TRAP_DB		1	/* debug, IST3 */
+#define TRAP_NMI	2	/* IST2 */
+#define TRAP_DF		8	/* double fault, runs on its own stack (IST1) */
+#define TRAP_MC		18	/* machine check, IST4 */
+#define TRAP_PF		14	/* page fault */
+#define TRAP_VECTORS	32
+
+/* The state saved by trap_common in kernel_asm.S, lowest address first */
+struct trap_frame {
+	uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+	uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+	uint64_t vector;
+	uint64_t error;		/* 0 for vectors without an error code */
+	/* pushed by the CPU */
+	uint64_t rip, cs, rflags, rsp, ss;
+};
+
+/* Load the IDT and the TSS; the TSS keeps kernel_stack for traps from user mode */
+void trap_init(void);
+
+/* The stack for traps from user mode, the current process's kernel stack */
+void trap_set_kernel_stack(void *top);
+
+/* Called by trap_common for every exception */
+void trap_entry(struct trap_frame *tf);
+
+#ifdef __cplusplus
+}
+#endif
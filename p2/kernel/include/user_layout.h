@@ -0,0 +1,56 @@
+#pragma once
+
+#include <types.h>
+
+/*
+ * The user address space, all of it in PML4[511] -> PDPT[511];
+ * must match user/include/user_layout.h
+ */
+
+/* The only PML4 entry that is not shared with the kernel */
+#define USER_PML4		511
+
+/*
+ * The last page, where load_page_table() expects the first page of the
+ * program (KERNEL_PT_4K); only mapped until that check has passed
+ */
+#define USER_PROGRAM_VA		0xFFFFFFFFFFFFF000ULL
+
+/* The stack grows down from there, pages are mapped on first touch */
+#define USER_STACK_TOP		USER_PROGRAM_VA
+#define USER_STACK_SIZE		(1ULL << 20)
+#define USER_STACK_VA		(USER_STACK_TOP - 4096)	/* the topmost stack page */
+
+/*
+ * The program image is mapped at USER_IMAGE_VA plus its physical offset
+ * within 2 MiB, so that 2 MiB pages fit wherever it spans an aligned block
+ */
+#define USER_IMAGE_VA		0xFFFFFFFFE0000000ULL
+#define USER_IMAGE_MAX		(256ULL << 20)
+
+/*
+ * The header that user/user.lds places after _start: text and read-only
+ * data (executable) end at text_end, writable data (no-execute) follows
+ */
+#define USER_IMAGE_MAGIC	0x474D495245535521ULL	/* "!USERIMG" */
+#define USER_IMAGE_HEADER	8	/* its offset in the image */
+
+struct user_image_header {
+	uint64_t magic;
+	uint64_t text_end;	/* page-aligned, from the start of the image */
+};
+
+/* The submission/completion rings (see ring.h), between the image and the stack */
+#define USER_RING_VA		0xFFFFFFFFF0000000ULL
+#define USER_RING_MAX		(1ULL << 20)
+
+/* The kernel data page (see vdso.h), read-only and shared by every process */
+#define USER_VDSO_VA		(USER_RING_VA + USER_RING_MAX)
+
+/* The brk() heap grows up from the last GiB */
+#define USER_HEAP_VA		0xFFFFFFFFC0000000ULL
+#define USER_HEAP_MAX		(512ULL << 20)
+
+/* mmap() places mappings in the rest of PML4[511] */
+#define USER_MMAP_BASE		0xFFFFFF8000000000ULL
+#define USER_MMAP_END		USER_HEAP_VA
@@ -0,0 +1,79 @@
+#pragma once
+
+/*
+ * What kernel_asm.S reads for the leaf calls: the offsets of the fields
+ * of struct vdso_data (vdso.c checks them) and the clock's fixed shift
+ */
+#define VDSO_STATUS	8
+#define VDSO_CPU	16
+#define VDSO_NS_MULT	32
+#define VDSO_CLOCK_TSC	48
+#define VDSO_CLOCK_NS	56
+#define VDSO_NS_SHIFT	32
+
+#ifndef __ASSEMBLER__
+
+#include <types.h>
+#include <proc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A page of kernel data mapped read-only at USER_VDSO_VA in every user
+ * address space, so that user space can read the kernel status, the CPU
+ * and the time without a system call (user/include/vdso.h). The kernel
+ * writes it under a seqlock: 'seq' is odd while an update is in
+ * progress. Must match user/include/vdso.h.
+ */
+#define VDSO_VERSION	1
+
+struct vdso_data {
+	uint32_t seq;
+	uint32_t version;
+	int64_t status;		/* kernel_status */
+	uint32_t cpu;		/* the APIC ID of the CPU that runs the process */
+	uint32_t node;		/* its NUMA node */
+
+	/*
+	 * The monotonic clock: ns = clock_ns + ((tsc - clock_tsc) * ns_mult) >> ns_shift,
+	 * ns_mult is 0 when the TSC rate is unknown
+	 */
+	uint64_t tsc_khz;
+	uint64_t ns_mult;
+	uint32_t ns_shift;
+	uint32_t reserved;
+	uint64_t clock_tsc;
+	uint64_t clock_ns;
+};
+
+/* The page itself, set by vdso_init() */
+extern struct vdso_data *vdso_page;
+
+/* Allocates and fills the page; 0 or -1 */
+int vdso_init(void);
+
+/*
+ * Maps the page into the address space of 'p' as a region of its own;
+ * 0 or -1. proc_create() does it for new spaces, fork() copies it.
+ */
+int vdso_map(struct process *p);
+
+/*
+ * Registers the C versions of the leaf calls that kernel_asm.S answers
+ * itself (SYS_CLOCK_NS, SYS_CPU_ID, SYS_YIELD_HINT), for the rings
+ */
+void vdso_syscalls_init(void);
+
+/*
+ * Refreshes the page (the status, the CPU, the clock base); the page
+ * follows each process through fork() as a shared read-only frame
+ */
+void vdso_update(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ASSEMBLER__ */
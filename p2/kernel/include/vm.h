@@ -0,0 +1,93 @@
+#pragma once
+
+#include <types.h>
+#include <paging.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Page-table mapping on top of the 1:1 mapped tables. 'flags' are PTE
+ * attribute bits (PTE_W, PTE_U, ...); PTE_P is implied. Ranges are 4 KiB
+ * aligned. Intermediate tables come from alloc_page() on demand, each piece
+ * of a range gets the largest page that its alignment and length allow, and
+ * large pages are split when only a part of them changes.
+ */
+
+/* A software flag: map with 4 KiB pages only */
+#define VM_SMALL_PAGES	(1ULL << 9)
+
+/* 0 on success, -1 on bad arguments or when out of page-table memory */
+int vm_map_range(uint64_t *pml4, uint64_t va, uint64_t pa, uint64_t len, uint64_t flags);
+int vm_unmap_range(uint64_t *pml4, uint64_t va, uint64_t len);
+/*
+ * Replace the attributes of the mapped pages in the range; shared
+ * copy-on-write pages (PTE_COW) stay read-only until their write fault
+ */
+int vm_protect(uint64_t *pml4, uint64_t va, uint64_t len, uint64_t flags);
+
+/*
+ * TLB invalidations are collected and flushed at the end of each call, or
+ * once for a whole begin/end section: with invlpg per page, or with a CR3
+ * reload past VM_FLUSH_MAX pages. Tables that are not loaded are not flushed:
+ * with PCIDs, their TLB entries survive until the owner flushes them (see
+ * proc_switch()). Changes to global (PTE_G) entries are flushed in any case
+ * since all address spaces share them, past VM_FLUSH_MAX by toggling CR4.PGE.
+ */
+#define VM_FLUSH_MAX	32
+
+void vm_batch_begin(void);
+void vm_batch_end(void);
+
+/*
+ * Enable no-execute pages (EFER.NXE); false if the CPU has none, PTE_NX is
+ * dropped from the attributes then
+ */
+bool vm_nx_init(void);
+
+/* Enable global pages (CR4.PGE), kernel mappings carry PTE_G */
+void vm_global_init(void);
+
+/* Flush the current PCID's TLB entries, or everything including globals */
+void vm_flush_tlb(bool global);
+
+/*
+ * The leaf entry mapping 'va' and its page size in 'size'; 0 if unmapped,
+ * 'size' is the size of the aligned hole around 'va' then
+ */
+uint64_t vm_lookup(uint64_t *pml4, uint64_t va, uint64_t *size);
+
+/*
+ * Free the page tables below PML4 entries [first, end) and clear those;
+ * the mapped frames are left alone and no TLB entries are flushed
+ */
+void vm_free_tables(uint64_t *pml4, size_t first, size_t end);
+
+/*
+ * Duplicates the mappings below PML4 entries [first, end) of 'src' into
+ * 'dst', whose entries there are empty. With 'cow', the frames are shared
+ * (page_get()) in 4 KiB pages, large pages of 'src' get split, and writable
+ * ones turn read-only PTE_COW in both tables; frames that cannot be shared
+ * are copied. Otherwise every page is copied up front. 0, or -1 when out of
+ * memory: what is in 'dst' by then is for the caller to release.
+ */
+int vm_copy_tables(uint64_t *dst, uint64_t *src, size_t first, size_t end, bool cow);
+
+/* The largest page size that the CPU supports */
+uint64_t vm_max_page_size(void);
+
+struct vm_stats {
+	size_t tables;		/* page-table pages allocated */
+	size_t tables_freed;	/* page-table pages freed */
+	size_t splits;		/* large pages split */
+	size_t invlpgs;		/* single-page flushes */
+	size_t cr3_reloads;	/* full flushes */
+	size_t global_flushes;	/* full flushes of global entries too */
+};
+
+void vm_stats(struct vm_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
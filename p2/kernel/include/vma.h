@@ -0,0 +1,63 @@
+#pragma once
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Virtual memory areas: disjoint [start, end) ranges of an address space
+ * in a red-black tree keyed by start address. Each node also keeps the
+ * free gap below it and the largest such gap in its subtree, so that
+ * lookups, updates and gap searches are all O(log n).
+ */
+struct vma {
+	struct vma *parent, *left, *right;
+	bool red;
+	uint64_t start;
+	uint64_t end;		/* exclusive */
+	uint64_t flags;		/* PTE_U | PTE_W, no PTE_U: inaccessible */
+	uint64_t gap;		/* free bytes between the previous area (or 0) and start */
+	uint64_t subtree_gap;	/* the largest 'gap' in this subtree */
+};
+
+struct vma_tree {
+	struct vma *root;
+	size_t count;
+};
+
+void vma_tree_init(struct vma_tree *t);
+/* Frees every area */
+void vma_tree_destroy(struct vma_tree *t);
+
+/* The area containing 'addr', NULL if none */
+struct vma *vma_find(const struct vma_tree *t, uint64_t addr);
+/* The first area that ends above 'addr', NULL if none */
+struct vma *vma_lower_bound(const struct vma_tree *t, uint64_t addr);
+
+/* In address order, NULL past the ends */
+struct vma *vma_first(const struct vma_tree *t);
+struct vma *vma_next(const struct vma *v);
+struct vma *vma_prev(const struct vma *v);
+
+/* A new area, NULL if it overlaps another one or no memory is left */
+struct vma *vma_insert(struct vma_tree *t, uint64_t start, uint64_t end, uint64_t flags);
+void vma_remove(struct vma_tree *t, struct vma *v);
+
+/* Cuts 'v' at 'addr' (inside it); returns the upper part, NULL if out of memory */
+struct vma *vma_split(struct vma_tree *t, struct vma *v, uint64_t addr);
+
+/* Joins 'v' with adjacent neighbours that have the same flags; returns the result */
+struct vma *vma_merge(struct vma_tree *t, struct vma *v);
+
+/* The lowest 'align'-aligned free range of 'len' bytes in [lo, hi), 0 if none */
+uint64_t vma_find_gap(const struct vma_tree *t, uint64_t lo, uint64_t hi,
+		      uint64_t len, uint64_t align);
+
+/* Checks the tree invariants, 0 or -1 (for tests) */
+int vma_check(const struct vma_tree *t);
+
+#ifdef __cplusplus
+}
+#endif
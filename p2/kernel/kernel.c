@@ -11,6 +11,12 @@
 #include <malloc.h>
 #include <fb.h>
 #include <printf.h>
+#include <page_alloc.h>
+#include <numa.h>
+#include <paging.h>
+#include <boot_info.h>
+#include <timeline.h>
+#include <trap.h>
 
 void *kernel_stack; /* Initialized in kernel_entry.S */
 void *syscall_entry_ptr; /* Points to syscall_entry_asm(), initialized in kernel_entry.S; workarounds a linker bug */
@@ -26,8 +32,11 @@ static void syscall_init(void)
 	/* A system call entry point */
 	wrmsr(MSR_LSTAR, (uint64_t) syscall_entry_ptr);
 
-	/* Disable interrupts (IF) while in a syscall */
-	wrmsr(MSR_SFMASK, 1U << 9);
+	/*
+	 * Clear IF (no interrupts), TF (no #DB), DF and AC on entry: the
+	 * entry code and the leaf calls run on the user's stack for a while
+	 */
+	wrmsr(MSR_SFMASK, (1U << 8) | (1U << 9) | (1U << 10) | (1U << 18));
 }
 
 #define KERNEL_HEAP_SIZE (1U << 20) /* 1MB */
@@ -39,17 +48,119 @@ void *kernel_memory_end = NULL;
 
 extern void *user_program;
 
+/* Conventional memory below 1 MiB is left alone */
+#define LOW_MEMORY_END (1ULL << 20)
+
+const boot_module_t *boot_find_module(const boot_info_t *bi, const char *name)
+{
+	uint32_t i;
+	for (i = 0; i < bi->module_count; i++) {
+		const char *a = bi->modules[i].name, *b = name;
+		while (*a != '\0' && *a == *b) {
+			a++;
+			b++;
+		}
+		if (*a == *b)
+			return &bi->modules[i];
+	}
+	return NULL;
+}
+
+/* The end of physical memory that the kernel page tables will map */
+static uint64_t identity_map_limit(const boot_info_t *bi)
+{
+#ifndef KERNEL_PT_4K
+	if (bi->cr3 != 0)
+		return bi->identity_map_size;
+#endif
+	return IDENTITY_MAP_MAX;
+}
+
+static void boot_modules_dump(const boot_info_t *bi)
+{
+	uint32_t i;
+	for (i = 0; i < bi->module_count; i++)
+		printf("Module %s: %zu KiB at %p\n", bi->modules[i].name,
+			(size_t) (bi->modules[i].size >> 10), (void *) bi->modules[i].base);
+}
+
+/* Give all EfiConventionalMemory from the UEFI memory map to the frame allocator */
+static void memory_map_init(const boot_info_t *bi)
+{
+	uint64_t limit = identity_map_limit(bi);
+	uint64_t off;
+
+	for (off = 0; off + bi->memory_desc_size <= bi->memory_map_size;
+			off += bi->memory_desc_size) {
+		const efi_memory_descriptor_t *desc =
+			(const efi_memory_descriptor_t *) (bi->memory_map + off);
+		uint64_t start = desc->phys_start;
+		uint64_t end = start + desc->pages * PAGE_SIZE;
+
+		if (desc->type != EFI_CONVENTIONAL_MEMORY)
+			continue;
+		if (start < LOW_MEMORY_END)
+			start = LOW_MEMORY_END;
+		if (end > limit)
+			end = limit;
+		if (start < end)
+			page_alloc_add_range((void *) start, end - start);
+	}
+}
+
+void kernel_idle(void)
+{
+	page_zero_refill(ZERO_POOL_MAX);
+	while (1)
+		__asm__ __volatile__ ("hlt");
+}
+
 /* The main program starts here */
-void kernel_start(void *kstack, void *ustack, unsigned int *fb, int width, int height,
-		  void *ucode, void *memory, unsigned long memorySize)
+void kernel_start(void *kstack, boot_info_t *bi)
 {
-	fb_init(fb, width, height);
+	/* A smaller block means the loader's copy of boot_info_t differs from ours */
+	if (bi->magic != BOOT_INFO_MAGIC || bi->version < BOOT_INFO_VERSION ||
+	    bi->size < sizeof(boot_info_t)) {
+		/* No console yet, nothing else to do */
+		while (1) {};
+	}
+
+	const boot_module_t *user = boot_find_module(bi, "USER");
+	void *memory = (void *) bi->memory;
+	uint64_t phys_top;
+
+	timeline_init(bi);
+	timeline_mark("kernel_start");
+	fb_init((unsigned int *) bi->fb_base, bi->fb_width, bi->fb_height);
+	timeline_mark("fb_init");
 	syscall_init();
+	timeline_mark("syscall_init");
+	trap_init();
+	timeline_mark("trap_init");
+	boot_modules_dump(bi);
+	if (user == NULL) {
+		printf("ERROR: no USER module\n");
+		while (1) {};
+	}
 	kernel_memory = memory + KERNEL_HEAP_SIZE;
-	kernel_memory_end = memory + memorySize;
+	kernel_memory_end = memory + bi->memory_size;
 	mem_init(memory, KERNEL_HEAP_SIZE);
-	kernel_init(ustack, ucode, memory + KERNEL_HEAP_SIZE, memorySize - KERNEL_HEAP_SIZE);
+	/* Zones are split by NUMA node */
+	numa_init(bi);
+	/* The first zone, page tables come from here unless it runs out */
+	page_alloc_add_range(kernel_memory, kernel_memory_end - kernel_memory);
+	memory_map_init(bi);
+	timeline_mark("mem_init");
+	numa_dump();
+
+	phys_top = page_alloc_top();
+	if (phys_top < bi->fb_base + bi->fb_size)
+		phys_top = bi->fb_base + bi->fb_size;
+	kernel_init(bi, user, phys_top);
+	timeline_mark("kernel_init");
+	/* The timeline is printed by the first system call */
+	timeline_mark("user_jump");
 	user_jump(user_program);
 	/* Never exit! */
-	while (1) {};
+	kernel_idle();
 }
\ No newline at end of file
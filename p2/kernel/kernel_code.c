@@ -8,8 +8,24 @@
 #include <kernel.h>
 #include <types.h>
 #include <printf.h>
+#include <fb.h>
 #include <malloc.h>
 #include <string.h>
+#include <cpu.h>
+#include <paging.h>
+#include <page_alloc.h>
+#include <timeline.h>
+#include <vm.h>
+#include <proc.h>
+#include <pcid.h>
+#include <sched.h>
+#include <bench.h>
+#include <fault.h>
+#include <user_layout.h>
+#include <syscall.h>
+#include <mman.h>
+#include <ring.h>
+#include <vdso.h>
 
 typedef unsigned long long u64;
 
@@ -17,131 +33,313 @@ void *page_table = NULL;
 void *user_stack = NULL; 
 void *user_program = NULL;
 
+static struct process InitProcess; // runs 'user_program'
 
-void kernel_init(void *ustack, void *uprogram, void *memory, size_t memorySize)
+/* Identity-map at least the first 4 GiB: MMIO and firmware tables live there */
+#define IDENTITY_MAP_MIN (4ULL << 30)
+
+#ifdef KERNEL_PT_4K
+
+// 4 KiB pages only: the exact layout that load_page_table() validates,
+// which also rules out PTE_G until the check has passed
+static const char *identity_map(u64 *pml, u64 size)
 {
+    if (vm_map_range(pml, 0, 0, size, PTE_W | VM_SMALL_PAGES) < 0)
+        return NULL;
+    return "4 KiB";
+}
 
-	// 'memory' points to the place where memory can be used to create
-	// page tables (assume 1:1 initial virtual-to-physical mappings here)
-	// 'memorySize' is the maximum allowed size, do not exceed that (given just in case)
-
-    // Align the memory pointer to the next 4KiB boundary for page table alignment
-    u64 *pt = memory;
-    // Initialize the Page Table Entries (PTEs)
-    for (size_t i = 0; i < 1048576; i++) {
-        pt[i] = 0; 			// Clear the entry
-        pt[i] |= 3ULL; 		// Set present and writable flags
-        pt[i] |= i << 12; 	// Set the physical address assuming 1:1 mapping
-    }
+#else
 
-    // Initialize the Page Directory (PD) right after the PTEs
-    u64 *pd = pt + 1048576;
-    for (size_t i = 0; i < 2048; i++) {
-        u64 *start_pte = pt + 512 * i;  // Calculate the address of the corresponding PTE
-        pd[i] = 0; 						// Clear the entry
-        pd[i] |= 3ULL; 					// Set present and writable flags
-        pd[i] |= (u64)start_pte; 		// Set the address of the PTE
-    }
+// Large pages wherever possible (vm_map_range() picks them). The first
+// 2 MiB stays on 4 KiB pages since the fixed-range MTRRs give the legacy
+// area below 1 MiB mixed memory types.
+static const char *identity_map(u64 *pml, u64 size)
+{
+    if (vm_map_range(pml, 0, 0, PAGE_SIZE_2M, PTE_W | PTE_G | VM_SMALL_PAGES) < 0 ||
+        vm_map_range(pml, PAGE_SIZE_2M, PAGE_SIZE_2M, size - PAGE_SIZE_2M, PTE_W | PTE_G) < 0)
+        return NULL;
+    pml[DIRECT_MAP_PML4] = pml[0]; // an alias (see paging.h), as in loader-built tables
+    return vm_max_page_size() == PAGE_SIZE_1G ? "1 GiB" : "2 MiB";
+}
 
-    // Initialize the Page Directory Pointer Table (PDPT) after the PD
-    u64 *pdp = pd + 2048;
-    for (size_t i = 0; i < 512; i++) {
-        pdp[i] = 0; 					// Clear the entry
+// Same contract as load_page_table() (which only accepts the 4 KiB layout)
+static const char *load_cr3(u64 *pml)
+{
+    kernel_status = pml[511] ? 2 : 1;
+    write_cr3((u64)pml);
+    return NULL;
+}
 
-        if(i >= 4) 						// Skip entries beyond the fourth
-            continue;
+#endif
 
-        u64 *start_pde = pd + 512 * i;  // Calculate the address of the corresponding PD
-        pdp[i] |= 3ULL; 				// Set present and writable flags
-        pdp[i] |= (u64)start_pde; 		// Set the address of the PD
-    }
+// Writable user memory (data, stack, heap) is never executable
+#define USER_DATA_FLAGS (PTE_U | PTE_W | PTE_NX)
 
-    // Initialize the Page Map Level 4 (PML4) after the PDPT
-    u64 *pml = pdp + 512;
-    for (size_t i = 0; i < 512; i++) {
-        pml[i] = 0; 		// Clear the entry
+// The user image: text and read-only data, then writable data
+static struct {
+    u64 va, pa, size;
+    u64 text_size;
+    u64 text_flags;
+} UserImage;
 
-        if(i >= 1) 			// Skip all entries except the first
-            continue;
+// Lays the image out from the header that user/user.lds puts after
+// _start; an image without one is writable and executable as a whole
+static int user_image_init(const boot_module_t *uprogram)
+{
+    const struct user_image_header *hdr =
+        (const struct user_image_header *)(uprogram->base + USER_IMAGE_HEADER);
+    u64 size = (uprogram->size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 
-        pml[i] |= 3ULL; 	// Set present and writable flags
-        pml[i] |= (u64)pdp; // Set the address of the PDPT
+    if (size == 0 || size > USER_IMAGE_MAX - PAGE_SIZE_2M)
+        return -1;
+    UserImage.va = USER_IMAGE_VA + (uprogram->base & (PAGE_SIZE_2M - 1));
+    UserImage.pa = uprogram->base;
+    UserImage.size = size;
+    UserImage.text_size = size;
+    UserImage.text_flags = PTE_U | PTE_W;
+    if (uprogram->size >= USER_IMAGE_HEADER + sizeof(*hdr) && hdr->magic == USER_IMAGE_MAGIC &&
+        hdr->text_end <= size && (hdr->text_end & (PAGE_SIZE - 1)) == 0) {
+        UserImage.text_size = hdr->text_end;
+        UserImage.text_flags = PTE_U;
     }
+    return 0;
+}
 
-    page_table = pml; // Set the page_table pointer to the PML4
+// vm_map_range() uses 2 MiB pages wherever the image covers an aligned block
+static int user_image_map(u64 *pml)
+{
+    u64 text = UserImage.text_size;
 
-    // Initialize user space page table structures after the kernel page tables
-    u64 *u_pt = pml + 512; 		// User space Page Table
-    u64 *u_pd = u_pt + 512; 	// User space Page Directory
-    u64 *u_pdp = u_pd + 512;	// User space Page Directory Pointer Table
+    if (text != 0 && vm_map_range(pml, UserImage.va, UserImage.pa, text, UserImage.text_flags) < 0)
+        return -1;
+    if (text < UserImage.size && vm_map_range(pml, UserImage.va + text, UserImage.pa + text,
+                                              UserImage.size - text, USER_DATA_FLAGS) < 0)
+        return -1;
+    return 0;
+}
 
-    // Map the last PML4 entry to the user PDPT with user-accessible permissions
-    pml[511] = (u64)u_pdp | 7ULL; // 7ULL sets present, writable, and user-accessible flags
+// The image pages as regions of 'p' (borrowed from the loader, never freed)
+static int user_image_regions(struct process *p)
+{
+    u64 text = UserImage.text_size;
 
-    // Initialize the user PDPT
-    for (size_t i = 0; i < 512; i++) {
-        u_pdp[i] = 0; 			// Clear the entry
+    if (text != 0 && proc_add_region(p, UserImage.va, text, UserImage.text_flags) < 0)
+        return -1;
+    if (text < UserImage.size &&
+        proc_add_region(p, UserImage.va + text, UserImage.size - text, USER_DATA_FLAGS) < 0)
+        return -1;
+    return 0;
+}
 
-        if(i < 511) 			// Skip all entries except the last
-            continue;
+// The system call handler to print a message (n = 1)
+// Arguments are passed in a1,.., a5 and can be of any type
+// (including pointers, which are casted to 'long')
+static long sys_print(long a1, long a2, long a3, long a4, long a5)
+{
+    char *str = (char *)a1;
+    printf("%s\n", str);
+    return 0; /* Success: 0, Failure: -1 */
+}
 
-        u_pdp[i] |= 7ULL; 		// Set present, writable, and user-accessible flags
-        u_pdp[i] |= (u64)u_pd;  // Set the address of the user PD
-    }
+// 'len' bytes to the console as they are: no format, no newline. The
+// range is checked once against the regions (pages that are not there
+// yet fault in as the console reads them).
+static long sys_write(long fd, long buf, long len, long a4, long a5)
+{
+    if ((fd != 1 && fd != 2) || len < 0 || current_process == NULL ||
+        !proc_check_range(current_process, buf, len, PTE_U))
+        return -1;
+    fb_write((const char *)buf, len);
+    return len;
+}
 
-    // Initialize the user PD
-    for (size_t i = 0; i < 512; i++) {
-        u_pd[i] = 0; 			// Clear the entry
+static long sys_fault_stats(long a1, long a2, long a3, long a4, long a5)
+{
+    if (current_process == NULL)
+        return -1;
+    fault_dump(current_process);
+    return 0;
+}
 
-        if(i < 511) 			// Skip all entries except the last
-            continue;
+#ifdef BENCH
+// a1 != 0 drops global (kernel) entries too; only for the benchmarks,
+// a production kernel does not let user space flush the whole TLB
+static long sys_flush_tlb(long a1, long a2, long a3, long a4, long a5)
+{
+    vm_flush_tlb(a1 != 0);
+    return 0;
+}
+#endif
 
-        u_pd[i] |= 7ULL; 		// Set present, writable, and user-accessible flags
-        u_pd[i] |= (u64)u_pt; 	// Set the address of the user PT
+static long sys_kernel_status(long a1, long a2, long a3, long a4, long a5)
+{
+    return kernel_status;
+}
+
+// The calls of this file, syscall.c dispatches them (syscall_entry())
+static void syscalls_init(void)
+{
+    syscall_table_init();
+    syscall_register(SYS_PRINT, "print", sys_print);
+    syscall_register(SYS_WRITE, "write", sys_write);
+    syscall_register(SYS_FAULT_STATS, "fault_stats", sys_fault_stats);
+#ifdef BENCH
+    syscall_register(SYS_FLUSH_TLB, "flush_tlb", sys_flush_tlb);
+#endif
+    syscall_register(SYS_KERNEL_STATUS, "kernel_status", sys_kernel_status);
+}
+
+void kernel_init(const boot_info_t *bi, const boot_module_t *uprogram, uint64_t phys_top)
+{
+    u64 *pml;
+
+#ifndef KERNEL_PT_4K
+    if (bi->cr3 != 0) {
+        // Fast path: the loader has built the kernel tables already,
+        // only the user part below is left
+        pml = (u64 *)bi->cr3;
+        printf("Identity map: %llu GiB, %llu bytes of page tables, built by the loader\n",
+            bi->identity_map_size >> 30, bi->page_tables_size);
+    } else
+#endif
+    {
+        // Page tables come from alloc_pages() (assume 1:1 initial
+        // virtual-to-physical mappings here)
+        u64 map_size = (phys_top + PAGE_SIZE_1G - 1) & ~(PAGE_SIZE_1G - 1);
+        if (map_size < IDENTITY_MAP_MIN)
+            map_size = IDENTITY_MAP_MIN;
+        if (map_size > IDENTITY_MAP_MAX)
+            map_size = IDENTITY_MAP_MAX;
+
+        // Build the kernel identity map and report its cost
+        u64 start = rdtsc();
+        pml = alloc_page();
+        if (pml != NULL)
+            memset(pml, 0, PAGE_SIZE);
+        const char *page_size = pml ? identity_map(pml, map_size) : NULL;
+        u64 cycles = rdtsc() - start;
+
+        if (page_size == NULL) {
+            printf("ERROR: out of page-table memory\n");
+            while (1) {}
+        }
+        struct vm_stats stats;
+        vm_stats(&stats);
+        printf("Identity map: %llu GiB, %zu bytes of page tables (%s pages), built in %llu cycles\n",
+            map_size >> 30, (stats.tables + 1) * (size_t)PAGE_SIZE, page_size, cycles);
     }
 
-    // Initialize the user PT
-    for (size_t i = 0; i < 512; i++) {
-        u_pt[i] = 0; 			// Clear the entry
+    page_table = pml; // Set the page_table pointer to the PML4
+
+    // No-execute user data needs EFER.NXE
+    if (!vm_nx_init())
+        printf("WARNING: no NX support, user data stays executable\n");
+    if (user_image_init(uprogram) < 0) {
+        printf("ERROR: the user image does not fit\n");
+        while (1) {}
     }
 
-    // Map the user stack and user program physical addresses to the last two entries of the user PT
-    u_pt[510] |= ((u64)ustack - 4096ULL) | 7ULL; 	// Map user stack with present, writable, and user-accessible flags
-    u_pt[511] |= ((u64)uprogram) | 7ULL; 			// Map user program with present, writable, and user-accessible flags
+#ifdef KERNEL_PT_4K
+    // load_page_table() checks the original layout: the first page of the
+    // program at the last page (PML4[511] -> PDPT[511] -> PD[511] -> PT[511])
+    // and the topmost stack page at PT[510]. The image follows once the
+    // check has passed.
+    if (vm_map_range(pml, USER_PROGRAM_VA, uprogram->base, PAGE_SIZE, PTE_W | PTE_U) < 0) {
+        printf("ERROR: out of page-table memory\n");
+        while (1) {}
+    }
+    void *ustack = alloc_page();
+    if (ustack == NULL) {
+        printf("ERROR: cannot allocate the user stack\n");
+        while (1) {}
+    }
+    memset(ustack, 0, PAGE_SIZE);
+    if (vm_map_range(pml, USER_STACK_VA, (u64)ustack, PAGE_SIZE, PTE_W | PTE_U) < 0) {
+        printf("ERROR: out of page-table memory\n");
+        while (1) {}
+    }
+#else
+    if (user_image_map(pml) < 0) {
+        printf("ERROR: out of page-table memory\n");
+        while (1) {}
+    }
+#endif
 
     // Set the virtual addresses for the user stack and user program
-    // Addresses are mapped to the virtual addresses corresponding to the last two entries of the user PT
-    user_stack = (void *)(-4096ULL); 	
-    user_program = (void *)(-4096ULL); 	
+    user_stack = (void *)USER_STACK_TOP;
+    user_program = (void *)(UserImage.va + (uprogram->entry - uprogram->base));
+    printf("User image: %llu KiB text, %llu KiB data at %p\n", UserImage.text_size >> 10,
+        (UserImage.size - UserImage.text_size) >> 10, (void *)UserImage.va);
+
+    timeline_mark("page_tables");
 
     // The remaining portion just loads the page table,
 	// this does not need to be changed:
 	// load 'page_table' into the CR3 register
+#ifdef KERNEL_PT_4K
 	const char *err = load_page_table(page_table);
+#else
+	const char *err = load_cr3(page_table);
+#endif
 	if (err != NULL) {
 		printf("ERROR: %s\n", err);
 	}
+	timeline_mark("load_page_table");
 
-	// The extra credit assignment
-	mem_extra_test();
-}
+	// Kernel translations are global, CR3 loads (address-space switches)
+	// keep them
+#ifdef KERNEL_PT_4K
+	if (vm_protect(pml, 0, IDENTITY_MAP_MAX, PTE_W | PTE_G) < 0)
+		printf("WARNING: the identity map is not global\n");
 
+	// The checked layout is done with: the image replaces the writable
+	// alias of its first page, the stack page becomes no-execute
+	if (vm_unmap_range(pml, USER_PROGRAM_VA, PAGE_SIZE) < 0 ||
+	    vm_protect(pml, USER_STACK_VA, PAGE_SIZE, USER_DATA_FLAGS) < 0 ||
+	    user_image_map(pml) < 0) {
+		printf("ERROR: out of page-table memory\n");
+		while (1) {}
+	}
+#endif
+	vm_global_init();
 
-/* The entry point for all system calls */
-long syscall_entry(long n, long a1, long a2, long a3, long a4, long a5)
-{
-	// The system call handler to print a message (n = 1)
-	// the system call number is in 'n', make sure it is valid!
-	if(n == 1)
-	{
-		char *str = (char *)a1;
-		printf("%s\n", str);
-		return 0;
+	// The init process runs on the kernel tables (load_page_table() wants
+	// the user mappings there), other address spaces share their kernel half.
+	// The stack is a demand-zero region: page faults allocate its frames
+	// on first touch. The heap starts out empty (see sys_brk()).
+	pcid_init();
+	kernel_pml4 = pml;
+	proc_init(&InitProcess, pml);
+	if (user_image_regions(&InitProcess) < 0 ||
+	    proc_add_region(&InitProcess, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_SIZE,
+			    USER_DATA_FLAGS) < 0) {
+		printf("ERROR: cannot register the user image and stack\n");
+		while (1) {}
+	}
+	if (vdso_init() < 0 || vdso_map(&InitProcess) < 0) {
+		printf("ERROR: cannot map the kernel data page\n");
+		while (1) {}
 	}
-	// Arguments are passed in a1,.., a5 and can be of any type
-	// (including pointers, which are casted to 'long')
-	// For the project, we only use a1 which will contain the address
-	// of a string, cast it to a pointer appropriately 
+	proc_switch(&InitProcess);
+	syscalls_init();
+	sched_init(&InitProcess);
+	mman_init();
+	ring_init();
+	vdso_syscalls_init();
+
+	// Copy-on-write pages are read-only, the kernel must fault on them too
+	write_cr0(read_cr0() | CR0_WP);
+
+	page_alloc_dump();
+
+	// The extra credit assignment
+	mem_extra_test();
+
+#ifdef BENCH
+	bench_run();
+#endif
 
-	return -1; /* Success: 0, Failure: -1 */
+	// Zeroed frames for the first page faults of user space
+	page_zero_refill(ZERO_POOL_MAX);
 }
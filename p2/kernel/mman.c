@@ -0,0 +1,188 @@
+/*
+ * mman.c - mmap(), munmap(), mprotect() and brk()
+ */
+
+#include <mman.h>
+#include <paging.h>
+#include <page_alloc.h>
+#include <proc.h>
+#include <string.h>
+#include <syscall.h>
+#include <user_layout.h>
+#include <vm.h>
+
+#define PROT_MASK	(PROT_READ | PROT_WRITE | PROT_EXEC)
+
+/* PROT_READ is implied by the others */
+static uint64_t prot_flags(long prot)
+{
+	if (prot == PROT_NONE)
+		return 0;
+	return PTE_U | ((prot & PROT_WRITE) ? PTE_W : 0) | ((prot & PROT_EXEC) ? 0 : PTE_NX);
+}
+
+static uint64_t page_align(uint64_t len)
+{
+	return (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+static bool in_mmap_area(uint64_t addr, uint64_t len)
+{
+	return addr >= USER_MMAP_BASE && len <= USER_MMAP_END - addr;
+}
+
+/* The next smaller page size that the page tables have */
+static uint64_t smaller_page(uint64_t size)
+{
+	return size == PAGE_SIZE_1G ? PAGE_SIZE_2M : PAGE_SIZE;
+}
+
+/* Maps zeroed frames, as large as the alignment allows; 0 or -1 */
+static int populate(struct process *p, uint64_t va, uint64_t len, uint64_t flags)
+{
+	while (len != 0) {
+		uint64_t size = vm_max_page_size();
+		void *block = NULL;
+
+		while (size > PAGE_SIZE && ((va & (size - 1)) != 0 || len < size))
+			size = smaller_page(size);
+		/* Fall back to smaller pages when memory is fragmented */
+		while (size > PAGE_SIZE && (block = alloc_pages(page_order(size))) == NULL)
+			size = smaller_page(size);
+		if (size == PAGE_SIZE) {
+			block = alloc_zeroed_page();
+			if (block == NULL)
+				return -1;
+		} else {
+			memset(block, 0, size);
+		}
+		if (vm_map_range(p->pml4, va, (uint64_t) block, size, flags) < 0) {
+			free_pages(block, page_order(size));
+			return -1;
+		}
+		va += size;
+		len -= size;
+	}
+	return 0;
+}
+
+long sys_mmap(uint64_t addr, uint64_t len, long prot, long flags, long fd)
+{
+	struct process *p = current_process;
+	uint64_t align = PAGE_SIZE;
+
+	len = page_align(len);
+	if (p == NULL || len == 0 || fd != -1 || (prot & ~PROT_MASK) != 0 ||
+	    !(flags & MAP_ANONYMOUS) || !(flags & MAP_PRIVATE))
+		return MAP_FAILED;
+
+	if (flags & MAP_FIXED) {
+		/* Replaces whatever was mapped there */
+		if ((addr & (PAGE_SIZE - 1)) != 0 || !in_mmap_area(addr, len) ||
+		    proc_remove_regions(p, addr, len) < 0)
+			return MAP_FAILED;
+		proc_release(p, addr, len);
+	} else {
+		/* Aligned for the largest pages that fit, so that they can back it */
+		while (align < vm_max_page_size() && len >= align * PT_ENTRIES)
+			align *= PT_ENTRIES;
+		addr = proc_find_gap(p, USER_MMAP_BASE, USER_MMAP_END, len, align);
+		if (addr == 0)
+			addr = proc_find_gap(p, USER_MMAP_BASE, USER_MMAP_END, len, PAGE_SIZE);
+		if (addr == 0)
+			return MAP_FAILED;
+	}
+
+	if (proc_add_region(p, addr, len, prot_flags(prot)) < 0)
+		return MAP_FAILED;
+	if ((flags & MAP_POPULATE) && prot != PROT_NONE &&
+	    populate(p, addr, len, prot_flags(prot)) < 0) {
+		proc_release(p, addr, len);
+		proc_remove_regions(p, addr, len);
+		return MAP_FAILED;
+	}
+	return (long) addr;
+}
+
+long sys_munmap(uint64_t addr, uint64_t len)
+{
+	struct process *p = current_process;
+
+	len = page_align(len);
+	if (p == NULL || (addr & (PAGE_SIZE - 1)) != 0 || len == 0 || !in_mmap_area(addr, len))
+		return -1;
+	if (proc_remove_regions(p, addr, len) < 0)
+		return -1;
+	proc_release(p, addr, len);
+	return 0;
+}
+
+long sys_mprotect(uint64_t addr, uint64_t len, long prot)
+{
+	struct process *p = current_process;
+
+	len = page_align(len);
+	if (p == NULL || (addr & (PAGE_SIZE - 1)) != 0 || len == 0 || (prot & ~PROT_MASK) != 0)
+		return -1;
+	/* The kernel writes to the rings, the data page stays read-only */
+	if (addr < USER_VDSO_VA + PAGE_SIZE && addr + len > USER_RING_VA)
+		return -1;
+	if (proc_protect_regions(p, addr, len, prot_flags(prot)) < 0 ||
+	    vm_protect(p->pml4, addr, len, prot_flags(prot)) < 0)
+		return -1;
+	return 0;
+}
+
+long sys_brk(uint64_t addr)
+{
+	struct process *p = current_process;
+	uint64_t old_end, new_end;
+
+	if (p == NULL)
+		return 0;
+	if (addr < USER_HEAP_VA || addr > USER_HEAP_VA + USER_HEAP_MAX)
+		return (long) p->brk;
+
+	old_end = page_align(p->brk);
+	new_end = page_align(addr);
+	if (new_end > old_end) {
+		/* Merges with the heap region below */
+		if (proc_add_region(p, old_end, new_end - old_end, PTE_U | PTE_W | PTE_NX) < 0)
+			return (long) p->brk;
+	} else if (new_end < old_end) {
+		if (proc_remove_regions(p, new_end, old_end - new_end) < 0)
+			return (long) p->brk;
+		proc_release(p, new_end, old_end - new_end);
+	}
+	p->brk = addr;
+	return (long) p->brk;
+}
+
+/* The table wants one signature for all calls */
+static long mmap_call(long a1, long a2, long a3, long a4, long a5)
+{
+	return sys_mmap(a1, a2, a3, a4, a5);
+}
+
+static long munmap_call(long a1, long a2, long a3, long a4, long a5)
+{
+	return sys_munmap(a1, a2);
+}
+
+static long mprotect_call(long a1, long a2, long a3, long a4, long a5)
+{
+	return sys_mprotect(a1, a2, a3);
+}
+
+static long brk_call(long a1, long a2, long a3, long a4, long a5)
+{
+	return sys_brk(a1);
+}
+
+void mman_init(void)
+{
+	syscall_register(SYS_MMAP, "mmap", mmap_call);
+	syscall_register(SYS_MUNMAP, "munmap", munmap_call);
+	syscall_register(SYS_MPROTECT, "mprotect", mprotect_call);
+	syscall_register(SYS_BRK, "brk", brk_call);
+}
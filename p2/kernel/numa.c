@@ -0,0 +1,344 @@
+/*
+ * numa.c - the NUMA topology from the ACPI SRAT and SLIT
+ *
+ * The table layouts follow Code/boot/include/IndustryStandard/Acpi*.h,
+ * only the parts that we need. The firmware tables are 1:1 mapped both
+ * under the loader's page tables and under ours.
+ */
+
+#include <numa.h>
+#include <cpu.h>
+#include <printf.h>
+#include <string.h>
+
+#define NUMA_RANGES_MAX	32
+
+struct acpi_rsdp {
+	char signature[8];	/* "RSD PTR " */
+	uint8_t checksum;	/* of the first 20 bytes */
+	char oem_id[6];
+	uint8_t revision;	/* 2 and up: the XSDT fields are valid */
+	uint32_t rsdt;
+	uint32_t length;
+	uint64_t xsdt;
+	uint8_t ext_checksum;
+	uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_header {
+	char signature[4];
+	uint32_t length;	/* of the whole table */
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__((packed));
+
+/* SRAT: the header, 12 reserved bytes, then the affinity structures */
+#define SRAT_ENTRIES		(sizeof(struct acpi_header) + 12)
+#define SRAT_CPU_APIC		0
+#define SRAT_MEMORY		1
+#define SRAT_CPU_X2APIC		2
+#define SRAT_ENABLED		1
+
+struct srat_cpu_apic {
+	uint8_t type;
+	uint8_t length;
+	uint8_t domain_low;
+	uint8_t apic_id;
+	uint32_t flags;
+	uint8_t sapic_eid;
+	uint8_t domain_high[3];
+	uint32_t clock_domain;
+} __attribute__((packed));
+
+struct srat_memory {
+	uint8_t type;
+	uint8_t length;
+	uint32_t domain;
+	uint16_t reserved0;
+	uint64_t base;
+	uint64_t size;
+	uint32_t reserved1;
+	uint32_t flags;
+	uint64_t reserved2;
+} __attribute__((packed));
+
+struct srat_cpu_x2apic {
+	uint8_t type;
+	uint8_t length;
+	uint16_t reserved0;
+	uint32_t domain;
+	uint32_t x2apic_id;
+	uint32_t flags;
+	uint32_t clock_domain;
+	uint32_t reserved1;
+} __attribute__((packed));
+
+/* SLIT: the header, the number of domains, then a row per domain */
+struct acpi_slit {
+	struct acpi_header header;
+	uint64_t domains;
+	uint8_t distance[];
+} __attribute__((packed));
+
+struct memory_range {
+	uint64_t start, end;
+	unsigned int node;
+};
+
+static uint32_t Domains[NUMA_NODES_MAX];	/* node -> proximity domain */
+static unsigned int NumNodes = 1;
+static unsigned int LocalNode = 0;
+static struct memory_range Ranges[NUMA_RANGES_MAX];
+static size_t NumRanges = 0;
+static uint8_t Distance[NUMA_NODES_MAX][NUMA_NODES_MAX];
+static uint8_t Fallback[NUMA_NODES_MAX][NUMA_NODES_MAX];
+static bool HaveSrat = false, HaveSlit = false;
+
+static bool signature_is(const char *signature, const char *name, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (signature[i] != name[i])
+			return false;
+	}
+	return true;
+}
+
+static bool checksum_ok(const void *table, size_t len)
+{
+	const uint8_t *p = table;
+	uint8_t sum = 0;
+
+	while (len-- != 0)
+		sum += *p++;
+	return sum == 0;
+}
+
+/* The table with 'signature' from the XSDT (or the RSDT), NULL if none */
+static const struct acpi_header *acpi_find(const struct acpi_rsdp *rsdp, const char *signature)
+{
+	const struct acpi_header *root;
+	size_t entry_size, i, n;
+
+	if (rsdp->revision >= 2 && rsdp->xsdt != 0) {
+		root = (const struct acpi_header *) rsdp->xsdt;
+		entry_size = sizeof(uint64_t);
+	} else {
+		root = (const struct acpi_header *) (uint64_t) rsdp->rsdt;
+		entry_size = sizeof(uint32_t);
+	}
+	if (root == NULL || root->length < sizeof(*root) || !checksum_ok(root, root->length))
+		return NULL;
+
+	n = (root->length - sizeof(*root)) / entry_size;
+	for (i = 0; i < n; i++) {
+		const uint8_t *entry = (const uint8_t *) (root + 1) + i * entry_size;
+		const struct acpi_header *table;
+		uint64_t addr = 0;
+
+		/* XSDT entries are not 8-byte aligned */
+		memcpy(&addr, entry, entry_size);
+		table = (const struct acpi_header *) addr;
+		if (table != NULL && signature_is(table->signature, signature, 4) &&
+		    table->length >= sizeof(*table) && checksum_ok(table, table->length))
+			return table;
+	}
+	return NULL;
+}
+
+/* The node of proximity domain 'domain', a new one if it has not been seen */
+static unsigned int domain_node(uint32_t domain)
+{
+	unsigned int node;
+
+	for (node = 0; node < NumNodes; node++) {
+		if (Domains[node] == domain)
+			return node;
+	}
+	if (NumNodes == NUMA_NODES_MAX) {
+		printf("WARNING: too many NUMA domains, %u goes to node 0\n", domain);
+		return 0;
+	}
+	Domains[NumNodes] = domain;
+	return NumNodes++;
+}
+
+static void parse_srat(const struct acpi_header *srat)
+{
+	const uint8_t *p = (const uint8_t *) srat + SRAT_ENTRIES;
+	const uint8_t *end = (const uint8_t *) srat + srat->length;
+	uint32_t self = cpu_apic_id();
+
+	/* Node 0 is the first domain listed rather than domain 0 */
+	NumNodes = 0;
+	for (; p + 2 <= end && p[1] >= 2 && p + p[1] <= end; p += p[1]) {
+		if (p[0] == SRAT_CPU_APIC && p[1] >= sizeof(struct srat_cpu_apic)) {
+			const struct srat_cpu_apic *cpu = (const void *) p;
+			uint32_t domain = cpu->domain_low | cpu->domain_high[0] << 8 |
+				cpu->domain_high[1] << 16 | (uint32_t) cpu->domain_high[2] << 24;
+
+			if (!(cpu->flags & SRAT_ENABLED))
+				continue;
+			if (cpu->apic_id == self)
+				LocalNode = domain_node(domain);
+			else
+				domain_node(domain);
+		} else if (p[0] == SRAT_CPU_X2APIC && p[1] >= sizeof(struct srat_cpu_x2apic)) {
+			const struct srat_cpu_x2apic *cpu = (const void *) p;
+
+			if (!(cpu->flags & SRAT_ENABLED))
+				continue;
+			if (cpu->x2apic_id == self)
+				LocalNode = domain_node(cpu->domain);
+			else
+				domain_node(cpu->domain);
+		} else if (p[0] == SRAT_MEMORY && p[1] >= sizeof(struct srat_memory)) {
+			const struct srat_memory *mem = (const void *) p;
+
+			if (!(mem->flags & SRAT_ENABLED) || mem->size == 0)
+				continue;
+			if (NumRanges == NUMA_RANGES_MAX) {
+				printf("WARNING: too many SRAT memory ranges\n");
+				continue;
+			}
+			Ranges[NumRanges].start = mem->base;
+			Ranges[NumRanges].end = mem->base + mem->size;
+			Ranges[NumRanges].node = domain_node(mem->domain);
+			NumRanges++;
+		}
+	}
+	if (NumNodes == 0)
+		NumNodes = 1;
+	HaveSrat = true;
+}
+
+static void parse_slit(const struct acpi_header *header)
+{
+	const struct acpi_slit *slit = (const struct acpi_slit *) header;
+	uint64_t n = slit->domains;
+	unsigned int from, to;
+
+	if (n == 0 || n > 0xFFFF || header->length < sizeof(*slit) + n * n)
+		return;
+	for (from = 0; from < NumNodes; from++) {
+		for (to = 0; to < NumNodes; to++) {
+			if (Domains[from] < n && Domains[to] < n)
+				Distance[from][to] = slit->distance[Domains[from] * n + Domains[to]];
+		}
+	}
+	HaveSlit = true;
+}
+
+/* Fallback[node]: all nodes by distance from 'node', ties by number */
+static void fallback_init(void)
+{
+	unsigned int node, i, j;
+
+	for (node = 0; node < NumNodes; node++) {
+		uint8_t *order = Fallback[node];
+
+		for (i = 0; i < NumNodes; i++) {
+			uint8_t cur = i;
+
+			/* Insertion sort, stable for equal distances */
+			for (j = i; j > 0 && Distance[node][order[j - 1]] > Distance[node][cur]; j--)
+				order[j] = order[j - 1];
+			order[j] = cur;
+		}
+	}
+}
+
+void numa_init(const boot_info_t *bi)
+{
+	const struct acpi_rsdp *rsdp = (const struct acpi_rsdp *) bi->rsdp;
+	const struct acpi_header *table;
+	unsigned int from, to;
+
+	if (rsdp != NULL && signature_is(rsdp->signature, "RSD PTR ", 8) &&
+	    checksum_ok(rsdp, 20)) {
+		table = acpi_find(rsdp, "SRAT");
+		if (table != NULL)
+			parse_srat(table);
+	}
+
+	for (from = 0; from < NumNodes; from++) {
+		for (to = 0; to < NumNodes; to++)
+			Distance[from][to] = from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+	}
+	if (HaveSrat && NumNodes > 1) {
+		table = acpi_find(rsdp, "SLIT");
+		if (table != NULL)
+			parse_slit(table);
+	}
+	fallback_init();
+}
+
+unsigned int numa_nodes(void)
+{
+	return NumNodes;
+}
+
+unsigned int numa_local_node(void)
+{
+	return LocalNode;
+}
+
+unsigned int numa_memory_node(uint64_t pa, uint64_t *end)
+{
+	uint64_t next = ~0ULL;
+	size_t i;
+
+	for (i = 0; i < NumRanges; i++) {
+		if (pa >= Ranges[i].start && pa < Ranges[i].end) {
+			*end = Ranges[i].end;
+			return Ranges[i].node;
+		}
+		if (Ranges[i].start > pa && Ranges[i].start < next)
+			next = Ranges[i].start;
+	}
+	/* Not in the SRAT: node 0 up to the next range that is */
+	*end = next;
+	return 0;
+}
+
+unsigned int numa_distance(unsigned int from, unsigned int to)
+{
+	if (from >= NumNodes || to >= NumNodes)
+		return NUMA_REMOTE_DISTANCE;
+	return Distance[from][to];
+}
+
+unsigned int numa_fallback(unsigned int node, unsigned int i)
+{
+	if (node >= NumNodes || i >= NumNodes)
+		return node;
+	return Fallback[node][i];
+}
+
+void numa_dump(void)
+{
+	unsigned int from, to;
+	size_t i;
+
+	if (!HaveSrat) {
+		printf("NUMA: no SRAT, one node\n");
+		return;
+	}
+	printf("NUMA: %u node(s), this CPU on node %u, distances from the %s\n",
+		NumNodes, LocalNode, HaveSlit ? "SLIT" : "defaults");
+	for (i = 0; i < NumRanges; i++)
+		printf("  node %u: %p - %p\n", Ranges[i].node, (void *) Ranges[i].start,
+			(void *) Ranges[i].end);
+	for (from = 0; from < NumNodes && NumNodes > 1; from++) {
+		printf("  distance from node %u (domain %u):", from, Domains[from]);
+		for (to = 0; to + 1 < NumNodes; to++)
+			printf(" %u", Distance[from][to]);
+		printf(" %u\n", Distance[from][to]);
+	}
+}
@@ -0,0 +1,439 @@
+/*
+ * page_alloc.c - a buddy allocator for physical page frames
+ *
+ * Memory is handed over in ranges (zones). Each zone keeps one state byte
+ * per frame and a doubly-linked free list per order, threaded through the
+ * free frames themselves (all managed memory is 1:1 mapped). Buddies are
+ * computed from absolute frame numbers, so every block is naturally aligned
+ * in physical memory and can back a large page of the same size. The state
+ * byte of an allocated frame counts its extra references (page_get()).
+ * Pre-zeroed frames wait in a stack of their own (alloc_zeroed_page()).
+ * Zones never span NUMA nodes, allocations try the zones of the closest
+ * node first.
+ */
+
+#include <page_alloc.h>
+#include <numa.h>
+#include <paging.h>
+#include <printf.h>
+#include <string.h>
+
+#define PAGE_ZONES_MAX	64
+
+#define FRAME_FREE	0x80	/* the head of a free block, low bits keep its order */
+#define FRAME_REFS	0x7F	/* an allocated frame: references - 1 */
+
+struct free_block {
+	struct free_block *next;
+	struct free_block *prev;
+};
+
+struct page_zone {
+	uint64_t first_pfn;
+	uint64_t end_pfn;
+	uint8_t *state;		/* one byte per frame */
+	struct free_block *free_list[PAGE_ORDERS];
+	size_t free_blocks[PAGE_ORDERS];
+	unsigned int node;
+};
+
+static struct page_zone Zones[PAGE_ZONES_MAX];
+static size_t NumZones = 0;
+static size_t TotalFrames = 0, FreeFrames = 0;
+static size_t Allocs = 0, Frees = 0, Failures = 0, RemoteAllocs = 0;
+
+static void *ZeroPool[ZERO_POOL_MAX];
+static size_t ZeroPoolSize = 0;
+static size_t ZeroHits = 0, ZeroMisses = 0;
+
+static inline struct free_block *pfn_to_block(uint64_t pfn)
+{
+	return (struct free_block *) (pfn * PAGE_SIZE);
+}
+
+static inline uint64_t addr_to_pfn(const void *addr)
+{
+	return (uint64_t) addr / PAGE_SIZE;
+}
+
+static void zone_push(struct page_zone *z, uint64_t pfn, unsigned int order)
+{
+	struct free_block *block = pfn_to_block(pfn);
+
+	block->prev = NULL;
+	block->next = z->free_list[order];
+	if (block->next)
+		block->next->prev = block;
+	z->free_list[order] = block;
+	z->free_blocks[order]++;
+	z->state[pfn - z->first_pfn] = FRAME_FREE | order;
+}
+
+static void zone_remove(struct page_zone *z, uint64_t pfn, unsigned int order)
+{
+	struct free_block *block = pfn_to_block(pfn);
+
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		z->free_list[order] = block->next;
+	if (block->next)
+		block->next->prev = block->prev;
+	z->free_blocks[order]--;
+	z->state[pfn - z->first_pfn] = 0;
+}
+
+/* Free a block and coalesce it with its buddies, O(PAGE_MAX_ORDER) */
+static void zone_free(struct page_zone *z, uint64_t pfn, unsigned int order)
+{
+	while (order < PAGE_MAX_ORDER) {
+		uint64_t buddy = pfn ^ (1ULL << order);
+
+		if (buddy < z->first_pfn || buddy + (1ULL << order) > z->end_pfn)
+			break;
+		if (z->state[buddy - z->first_pfn] != (FRAME_FREE | order))
+			break;
+		zone_remove(z, buddy, order);
+		pfn &= ~(1ULL << order);
+		order++;
+	}
+	zone_push(z, pfn, order);
+}
+
+/*
+ * Whether a free block covers frame 'pfn': blocks are aligned to their
+ * order, so its head is 'pfn' rounded down to one of the orders
+ */
+static bool zone_covered(const struct page_zone *z, uint64_t pfn)
+{
+	unsigned int order;
+
+	for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+		uint64_t head = pfn & ~((1ULL << order) - 1);
+
+		if (head < z->first_pfn)
+			break;
+		if (z->state[head - z->first_pfn] == (FRAME_FREE | order))
+			return true;
+	}
+	return false;
+}
+
+/* Take a block from the smallest order that fits and split it down */
+static void *zone_alloc(struct page_zone *z, unsigned int order)
+{
+	unsigned int cur = order;
+	uint64_t pfn;
+
+	while (z->free_list[cur] == NULL) {
+		if (++cur > PAGE_MAX_ORDER)
+			return NULL;
+	}
+
+	pfn = addr_to_pfn(z->free_list[cur]);
+	zone_remove(z, pfn, cur);
+	while (cur > order) {
+		cur--;
+		zone_push(z, pfn + (1ULL << cur), cur);
+	}
+	return pfn_to_block(pfn);
+}
+
+static struct page_zone *zone_find(uint64_t pfn)
+{
+	size_t i;
+	for (i = 0; i < NumZones; i++) {
+		if (pfn >= Zones[i].first_pfn && pfn < Zones[i].end_pfn)
+			return &Zones[i];
+	}
+	return NULL;
+}
+
+static void zone_add(void *start, size_t size, unsigned int node)
+{
+	uint64_t first = ((uint64_t) start + PAGE_SIZE - 1) / PAGE_SIZE;
+	uint64_t end = ((uint64_t) start + size) / PAGE_SIZE;
+	uint64_t meta, pfn;
+	struct page_zone *z;
+
+	if (first == 0) /* never hand out NULL */
+		first = 1;
+	if (end <= first + 1)
+		return;
+	if (NumZones == PAGE_ZONES_MAX) {
+		printf("WARNING: too many memory ranges, dropping %zu KiB\n",
+			(size_t) ((end - first) * (PAGE_SIZE / 1024)));
+		return;
+	}
+
+	/* The state bytes live at the start of the range itself */
+	meta = (end - first + PAGE_SIZE - 1) / PAGE_SIZE;
+	z = &Zones[NumZones++];
+	memset(z, 0, sizeof(*z));
+	z->node = node;
+	z->state = (uint8_t *) pfn_to_block(first);
+	z->first_pfn = first + meta;
+	z->end_pfn = end;
+	memset(z->state, 0, z->end_pfn - z->first_pfn);
+
+	for (pfn = z->first_pfn; pfn < z->end_pfn; pfn++)
+		zone_free(z, pfn, 0);
+
+	TotalFrames += z->end_pfn - z->first_pfn;
+	FreeFrames += z->end_pfn - z->first_pfn;
+}
+
+/* One zone per NUMA node that the range spans */
+void page_alloc_add_range(void *start, size_t size)
+{
+	uint64_t addr = (uint64_t) start, end = addr + size, node_end;
+	unsigned int node;
+
+	while (addr < end) {
+		node = numa_memory_node(addr, &node_end);
+		if (node_end > end)
+			node_end = end;
+		zone_add((void *) addr, node_end - addr, node);
+		addr = node_end;
+	}
+}
+
+static void *try_alloc(unsigned int order, unsigned int node)
+{
+	size_t i;
+
+	for (i = 0; i < NumZones; i++) {
+		void *addr;
+
+		if (Zones[i].node != node)
+			continue;
+		addr = zone_alloc(&Zones[i], order);
+		if (addr != NULL) {
+			FreeFrames -= 1ULL << order;
+			Allocs++;
+			return addr;
+		}
+	}
+	return NULL;
+}
+
+/* From 'node' or the closest node that has a block */
+static void *try_alloc_near(unsigned int order, unsigned int node)
+{
+	unsigned int i;
+	void *addr;
+
+	for (i = 0; i < numa_nodes(); i++) {
+		addr = try_alloc(order, numa_fallback(node, i));
+		if (addr != NULL) {
+			if (i != 0)
+				RemoteAllocs++;
+			return addr;
+		}
+	}
+	return NULL;
+}
+
+void *alloc_pages_node(unsigned int order, unsigned int node)
+{
+	void *addr = NULL;
+
+	if (order <= PAGE_MAX_ORDER) {
+		addr = try_alloc_near(order, node);
+		/* The zeroed frames are only a cache */
+		if (addr == NULL && ZeroPoolSize != 0) {
+			while (ZeroPoolSize != 0)
+				free_pages(ZeroPool[--ZeroPoolSize], 0);
+			addr = try_alloc_near(order, node);
+		}
+	}
+	if (addr == NULL)
+		Failures++;
+	return addr;
+}
+
+void *alloc_pages(unsigned int order)
+{
+	return alloc_pages_node(order, numa_local_node());
+}
+
+/* Zeroes a frame with non-temporal stores, the caller fences */
+static void zero_page_nt(void *page)
+{
+	uint64_t *p = page, *end = p + PAGE_SIZE / sizeof(uint64_t);
+
+	for (; p < end; p += 8) {
+		__asm__ __volatile__ (
+			"movnti %1, 0(%0)\n\tmovnti %1, 8(%0)\n\t"
+			"movnti %1, 16(%0)\n\tmovnti %1, 24(%0)\n\t"
+			"movnti %1, 32(%0)\n\tmovnti %1, 40(%0)\n\t"
+			"movnti %1, 48(%0)\n\tmovnti %1, 56(%0)"
+			: : "r" (p), "r" (0ULL) : "memory");
+	}
+}
+
+size_t page_zero_refill(size_t max)
+{
+	size_t added = 0;
+	void *page;
+
+	while (added < max && ZeroPoolSize < ZERO_POOL_MAX) {
+		page = try_alloc(0, numa_local_node());
+		if (page == NULL)
+			break;
+		zero_page_nt(page);
+		ZeroPool[ZeroPoolSize++] = page;
+		added++;
+	}
+	/* The zeroes must be visible before any frame is handed out */
+	__asm__ __volatile__ ("sfence" : : : "memory");
+	return added;
+}
+
+void page_zero_top_up(void)
+{
+	if (ZeroPoolSize < ZERO_POOL_LOW)
+		page_zero_refill(ZERO_REFILL_BATCH);
+}
+
+void *alloc_zeroed_page(void)
+{
+	void *page;
+
+	if (ZeroPoolSize != 0) {
+		ZeroHits++;
+		return ZeroPool[--ZeroPoolSize];
+	}
+	ZeroMisses++;
+	page = alloc_page();
+	if (page != NULL)
+		memset(page, 0, PAGE_SIZE);
+	return page;
+}
+
+void free_pages(void *addr, unsigned int order)
+{
+	uint64_t pfn = addr_to_pfn(addr);
+	struct page_zone *z = zone_find(pfn);
+
+	if (addr == NULL)
+		return;
+	if (z == NULL || order > PAGE_MAX_ORDER || (pfn & ((1ULL << order) - 1)) != 0
+			|| pfn + (1ULL << order) > z->end_pfn) {
+		printf("ERROR: free_pages(%p, %u) of an unknown block\n", addr, order);
+		return;
+	}
+	/* A double free, also of a frame inside a larger free block */
+	if (zone_covered(z, pfn)) {
+		printf("ERROR: free_pages(%p, %u) of a free block\n", addr, order);
+		return;
+	}
+	zone_free(z, pfn, order);
+	FreeFrames += 1ULL << order;
+	Frees++;
+}
+
+unsigned int page_node(void *addr)
+{
+	struct page_zone *z = zone_find(addr_to_pfn(addr));
+
+	return z != NULL ? z->node : 0;
+}
+
+/* The state byte of an allocated frame, NULL if the frame is not ours */
+static uint8_t *frame_state(void *addr)
+{
+	uint64_t pfn = addr_to_pfn(addr);
+	struct page_zone *z = zone_find(pfn);
+
+	if (z == NULL || (z->state[pfn - z->first_pfn] & FRAME_FREE))
+		return NULL;
+	return &z->state[pfn - z->first_pfn];
+}
+
+bool page_get(void *addr)
+{
+	uint8_t *state = frame_state(addr);
+
+	if (state == NULL || *state == FRAME_REFS)
+		return false;
+	(*state)++;
+	return true;
+}
+
+void page_put(void *addr)
+{
+	uint8_t *state = frame_state(addr);
+
+	if (state == NULL)
+		return;
+	if (*state != 0)
+		(*state)--;
+	else
+		free_pages(addr, 0);
+}
+
+unsigned int page_refs(void *addr)
+{
+	uint8_t *state = frame_state(addr);
+
+	return state != NULL ? *state + 1U : 0;
+}
+
+uint64_t page_alloc_top(void)
+{
+	uint64_t top = 0;
+	size_t i;
+	for (i = 0; i < NumZones; i++) {
+		if (Zones[i].end_pfn * PAGE_SIZE > top)
+			top = Zones[i].end_pfn * PAGE_SIZE;
+	}
+	return top;
+}
+
+void page_alloc_stats(struct page_alloc_stats *stats)
+{
+	size_t i, order;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->total_frames = TotalFrames;
+	stats->free_frames = FreeFrames;
+	stats->allocs = Allocs;
+	stats->frees = Frees;
+	stats->failures = Failures;
+	stats->remote_allocs = RemoteAllocs;
+	stats->zero_pool = ZeroPoolSize;
+	stats->zero_hits = ZeroHits;
+	stats->zero_misses = ZeroMisses;
+	for (i = 0; i < NumZones; i++) {
+		for (order = 0; order < PAGE_ORDERS; order++) {
+			stats->free_blocks[order] += Zones[i].free_blocks[order];
+			stats->node_free[Zones[i].node] +=
+				Zones[i].free_blocks[order] << order;
+		}
+	}
+}
+
+void page_alloc_dump(void)
+{
+	struct page_alloc_stats stats;
+	size_t order;
+	unsigned int node;
+
+	page_alloc_stats(&stats);
+	printf("Frames: %zu free of %zu, %zu allocs, %zu frees, %zu failures\n",
+		stats.free_frames, stats.total_frames, stats.allocs, stats.frees,
+		stats.failures);
+	printf("Free blocks by order:");
+	for (order = 0; order < PAGE_MAX_ORDER; order++)
+		printf(" %zu", stats.free_blocks[order]);
+	printf(" %zu\n", stats.free_blocks[PAGE_MAX_ORDER]);
+	printf("Zeroed frames: %zu in the pool, %zu hits, %zu misses\n", stats.zero_pool,
+		stats.zero_hits, stats.zero_misses);
+	if (numa_nodes() > 1) {
+		printf("Free frames by node:");
+		for (node = 0; node < numa_nodes(); node++)
+			printf(" %zu", stats.node_free[node]);
+		printf(", %zu allocs from a remote node\n", stats.remote_allocs);
+	}
+}
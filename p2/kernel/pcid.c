@@ -0,0 +1,46 @@
+/*
+ * pcid.c - the pool of process-context identifiers
+ */
+
+#include <pcid.h>
+#include <cpu.h>
+
+static bool Enabled = false;
+static uint64_t Used = 1;	/* one bit per PCID, 0 is reserved */
+
+void pcid_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	if (!(ecx & CPUID_1_ECX_PCID) || (read_cr3() & CR3_PCID_MASK) != 0)
+		return;
+	write_cr4(read_cr4() | CR4_PCIDE);
+	Enabled = true;
+}
+
+bool pcid_enabled(void)
+{
+	return Enabled;
+}
+
+uint16_t pcid_alloc(void)
+{
+	uint16_t pcid;
+
+	if (!Enabled)
+		return 0;
+	for (pcid = 1; pcid < PCID_MAX; pcid++) {
+		if (!(Used & (1ULL << pcid))) {
+			Used |= 1ULL << pcid;
+			return pcid;
+		}
+	}
+	return 0;
+}
+
+void pcid_free(uint16_t pcid)
+{
+	if (pcid != 0 && pcid < PCID_MAX)
+		Used &= ~(1ULL << pcid);
+}
@@ -0,0 +1,232 @@
+/*
+ * proc.c - user processes and their demand-zero regions
+ */
+
+#include <proc.h>
+#include <cpu.h>
+#include <paging.h>
+#include <page_alloc.h>
+#include <pcid.h>
+#include <string.h>
+#include <user_layout.h>
+#include <vdso.h>
+#include <vm.h>
+
+struct process *current_process = NULL;
+uint64_t *kernel_pml4 = NULL;
+
+void proc_init(struct process *p, uint64_t *pml4)
+{
+	memset(p, 0, sizeof(*p));
+	p->pml4 = pml4;
+	p->pcid = pcid_alloc();
+	p->tlb_stale = true;	/* a PCID may have entries of its previous owner */
+	vma_tree_init(&p->vmas);
+	p->brk = USER_HEAP_VA;
+}
+
+/* An empty user half, fork() fills it with a copy of the parent's */
+static int space_create(struct process *p)
+{
+	uint64_t *pml4 = alloc_page();
+
+	if (pml4 == NULL)
+		return -1;
+	memcpy(pml4, kernel_pml4, USER_PML4 * sizeof(uint64_t));
+	memset(pml4 + USER_PML4, 0, (PT_ENTRIES - USER_PML4) * sizeof(uint64_t));
+	proc_init(p, pml4);
+	return 0;
+}
+
+int proc_create(struct process *p)
+{
+	if (space_create(p) < 0)
+		return -1;
+	/* There is no data page before vdso_init() */
+	if (vdso_page != NULL && vdso_map(p) < 0) {
+		proc_destroy(p);
+		return -1;
+	}
+	return 0;
+}
+
+void proc_destroy(struct process *p)
+{
+	struct vma *v;
+
+	/*
+	 * Region frames are the process's own or shared copy-on-write, except
+	 * for the loader's image of the init process (page_put() skips those)
+	 */
+	for (v = vma_first(&p->vmas); v != NULL; v = vma_next(v))
+		proc_release(p, v->start, v->end - v->start);
+	vma_tree_destroy(&p->vmas);
+	vm_free_tables(p->pml4, USER_PML4, PT_ENTRIES);
+	if (p->pml4 != kernel_pml4)
+		free_page(p->pml4);
+	pcid_free(p->pcid);
+	memset(p, 0, sizeof(*p));
+}
+
+int proc_fork(struct process *child, struct process *parent, bool cow)
+{
+	struct vma *v;
+
+	if (space_create(child) < 0)
+		return -1;
+	for (v = vma_first(&parent->vmas); v != NULL; v = vma_next(v)) {
+		if (vma_insert(&child->vmas, v->start, v->end, v->flags) == NULL)
+			goto fail;
+	}
+	child->brk = parent->brk;
+	child->ring_entries = parent->ring_entries;
+	child->ring_flags = parent->ring_flags;
+	child->ring_sq_head = parent->ring_sq_head;
+	child->ring_cq_tail = parent->ring_cq_tail;
+	/* Entries that turn read-only may be cached for a parent that is not loaded */
+	if (parent != current_process)
+		parent->tlb_stale = true;
+	if (vm_copy_tables(child->pml4, parent->pml4, USER_PML4, PT_ENTRIES, cow) < 0)
+		goto fail;
+	return 0;
+fail:
+	proc_destroy(child);
+	return -1;
+}
+
+void proc_switch(struct process *p)
+{
+	uint64_t cr3 = (uint64_t) p->pml4;
+
+	if (p->pcid != 0) {
+		cr3 |= p->pcid;
+		if (!p->tlb_stale)
+			cr3 |= CR3_NOFLUSH;
+	}
+	p->tlb_stale = false;
+	write_cr3(cr3);
+	current_process = p;
+}
+
+static bool range_valid(uint64_t start, uint64_t len)
+{
+	return ((start | len) & (PAGE_SIZE - 1)) == 0 && start + len > start;
+}
+
+int proc_add_region(struct process *p, uint64_t start, uint64_t len, uint64_t flags)
+{
+	struct vma *v;
+
+	if (!range_valid(start, len))
+		return -1;
+	v = vma_insert(&p->vmas, start, start + len, flags);
+	if (v == NULL)
+		return -1;
+	vma_merge(&p->vmas, v);
+	return 0;
+}
+
+struct vma *proc_find_region(struct process *p, uint64_t addr)
+{
+	return vma_find(&p->vmas, addr);
+}
+
+bool proc_check_range(struct process *p, uint64_t start, uint64_t len, uint64_t flags)
+{
+	uint64_t end = start + len;
+	const struct vma *v;
+
+	if (end < start)
+		return false;
+	while (start < end) {
+		v = vma_find(&p->vmas, start);
+		if (v == NULL || (v->flags & flags) != flags)
+			return false;
+		start = v->end;
+	}
+	return true;
+}
+
+/* Makes 'addr' a region boundary */
+static int split_at(struct process *p, uint64_t addr)
+{
+	struct vma *v = vma_find(&p->vmas, addr);
+
+	if (v == NULL || v->start == addr)
+		return 0;
+	return vma_split(&p->vmas, v, addr) != NULL ? 0 : -1;
+}
+
+int proc_remove_regions(struct process *p, uint64_t start, uint64_t len)
+{
+	uint64_t end = start + len;
+	struct vma *v, *next;
+
+	if (!range_valid(start, len) || split_at(p, start) < 0 || split_at(p, end) < 0)
+		return -1;
+	for (v = vma_lower_bound(&p->vmas, start); v != NULL && v->start < end; v = next) {
+		next = vma_next(v);
+		vma_remove(&p->vmas, v);
+	}
+	return 0;
+}
+
+int proc_protect_regions(struct process *p, uint64_t start, uint64_t len, uint64_t flags)
+{
+	uint64_t end = start + len, addr;
+	struct vma *v;
+
+	if (!range_valid(start, len))
+		return -1;
+	for (addr = start; addr < end; addr = v->end) {
+		v = vma_find(&p->vmas, addr);
+		if (v == NULL)
+			return -1;
+	}
+	if (split_at(p, start) < 0 || split_at(p, end) < 0)
+		return -1;
+	for (v = vma_find(&p->vmas, start); v != NULL && v->start < end; v = vma_next(v)) {
+		v->flags = flags;
+		v = vma_merge(&p->vmas, v);
+	}
+	return 0;
+}
+
+uint64_t proc_find_gap(const struct process *p, uint64_t lo, uint64_t hi,
+		       uint64_t len, uint64_t align)
+{
+	return vma_find_gap(&p->vmas, lo, hi, len, align);
+}
+
+void proc_release(struct process *p, uint64_t start, uint64_t len)
+{
+	uint64_t va = start;
+
+	/* vm only flushes the loaded tables, the others flush on their next switch */
+	if (p != current_process)
+		p->tlb_stale = true;
+
+	/* The range may end at the top of the address space */
+	while (len != 0) {
+		uint64_t size, entry = vm_lookup(p->pml4, va, &size);
+		uint64_t chunk = size - (va & (size - 1));
+		uint64_t pa, off;
+
+		if (chunk > len)
+			chunk = len;
+		if (entry != 0) {
+			pa = (entry & PTE_ADDR_MASK & ~(size - 1)) + (va & (size - 1));
+			vm_unmap_range(p->pml4, va, chunk);
+			if (chunk == size && size != PAGE_SIZE) {
+				/* Large pages are never shared */
+				free_pages((void *) pa, page_order(size));
+			} else {
+				/* 4 KiB frames may be, a part of a large page goes back one by one */
+				for (off = 0; off < chunk; off += PAGE_SIZE)
+					page_put((void *) (pa + off));
+			}
+		}
+		va += chunk;
+		len -= chunk;
+	}
+}
@@ -0,0 +1,117 @@
+/*
+ * ring.c - submission/completion rings for batched system calls
+ *
+ * The rings are an ordinary demand-zero region of the process at
+ * USER_RING_VA, which the kernel reads and writes through the user
+ * mapping while the process is current (munmap() and mprotect() leave
+ * it alone). Queued calls go through the system call table and its
+ * counters like any other; they all complete before SYS_RING_ENTER
+ * returns. x86 keeps stores in order and loads in order, so compiler
+ * barriers around the indices are enough.
+ */
+
+#include <ring.h>
+#include <paging.h>
+#include <syscall.h>
+#include <user_layout.h>
+
+static inline uint32_t load_index(const uint32_t *index)
+{
+	uint32_t v = *(const volatile uint32_t *) index;
+
+	__asm__ __volatile__ ("" : : : "memory");
+	return v;
+}
+
+static inline void store_index(uint32_t *index, uint32_t v)
+{
+	__asm__ __volatile__ ("" : : : "memory");
+	*(volatile uint32_t *) index = v;
+}
+
+/* Calls that block, switch processes or recurse stay out of the rings */
+static bool queueable(uint64_t nr)
+{
+	return nr != SYS_FORK && nr != SYS_EXIT && nr != SYS_WAIT &&
+		nr != SYS_RING_SETUP && nr != SYS_RING_ENTER;
+}
+
+/* Runs the queued calls while the completion ring has room; how many */
+static long ring_run(struct process *p)
+{
+	struct ring_header *h = (struct ring_header *) USER_RING_VA;
+	struct ring_sqe *sqes = (struct ring_sqe *) (USER_RING_VA + RING_SQES_OFFSET);
+	struct ring_cqe *cqes = (struct ring_cqe *) (USER_RING_VA + RING_CQES_OFFSET(p->ring_entries));
+	uint32_t sq_mask = p->ring_entries - 1, cq_entries = 2 * p->ring_entries;
+	uint32_t head = p->ring_sq_head, tail = load_index(&h->sq_tail);
+	long done = 0;
+
+	/* A tail that runs too far ahead is garbage, take one ring's worth */
+	if (tail - head > p->ring_entries)
+		tail = head + p->ring_entries;
+	while (head != tail) {
+		struct ring_sqe sqe = sqes[head & sq_mask];
+		struct ring_cqe *cqe;
+		int64_t result;
+
+		if (p->ring_cq_tail - load_index(&h->cq_head) >= cq_entries)
+			break;
+		result = queueable(sqe.nr) ? syscall_call(sqe.nr, sqe.args[0], sqe.args[1],
+			sqe.args[2], sqe.args[3], sqe.args[4]) : -1;
+
+		cqe = &cqes[p->ring_cq_tail & (cq_entries - 1)];
+		cqe->user_data = sqe.user_data;
+		cqe->result = result;
+		store_index(&h->cq_tail, ++p->ring_cq_tail);
+		store_index(&h->sq_head, ++head);
+		done++;
+	}
+	p->ring_sq_head = head;
+	return done;
+}
+
+void ring_poll(struct process *p)
+{
+	if (p->ring_entries != 0)
+		ring_run(p);
+}
+
+/* The rings for 'entries' (a power of two) submissions; USER_RING_VA or -1 */
+static long sys_ring_setup(long entries, long flags, long a3, long a4, long a5)
+{
+	struct process *p = current_process;
+	struct ring_header *h = (struct ring_header *) USER_RING_VA;
+	uint64_t size = (RING_SIZE((uint64_t) entries) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+	if (p == NULL || p->ring_entries != 0 || entries <= 0 || entries > RING_ENTRIES_MAX ||
+	    (entries & (entries - 1)) != 0 || (flags & ~RING_POLL) != 0)
+		return -1;
+	if (proc_add_region(p, USER_RING_VA, size, PTE_U | PTE_W | PTE_NX) < 0)
+		return -1;
+
+	/* The first touch faults the header page in */
+	h->sq_entries = entries;
+	h->cq_entries = 2 * entries;
+	h->flags = flags;
+	p->ring_entries = entries;
+	p->ring_flags = flags;
+	p->ring_sq_head = 0;
+	p->ring_cq_tail = 0;
+	return (long) USER_RING_VA;
+}
+
+/* Runs everything queued so far; the number of calls, -1 without rings */
+static long sys_ring_enter(long a1, long a2, long a3, long a4, long a5)
+{
+	struct process *p = current_process;
+
+	if (p == NULL || p->ring_entries == 0)
+		return -1;
+	return ring_run(p);
+}
+
+void ring_init(void)
+{
+	syscall_register(SYS_RING_SETUP, "ring_setup", sys_ring_setup);
+	syscall_register(SYS_RING_ENTER, "ring_enter", sys_ring_enter);
+}
@@ -0,0 +1,181 @@
+/*
+ * sched.c - fork(), exit() and wait(): processes take turns on one CPU
+ *
+ * Processes only switch inside system calls, when one waits for a child or
+ * exits, so each one that is switched out sits in a system call on its own
+ * kernel stack (context_switch()). A forked child starts out on a copy of
+ * its parent's system-call frame and returns 0 to the same user code.
+ */
+
+#include <sched.h>
+#include <kernel.h>
+#include <page_alloc.h>
+#include <paging.h>
+#include <printf.h>
+#include <string.h>
+#include <syscall.h>
+#include <trap.h>
+#include <vdso.h>
+
+#define PROC_MAX		16
+#define KSTACK_ORDER		2	/* 16 KiB kernel stacks */
+#define FORK_FRAME_WORDS	14	/* 8 saved by syscall_entry_asm, 6 callee-saved */
+#define SWITCH_WORDS		6	/* the callee-saved registers of context_switch() */
+
+extern char fork_return[];	/* kernel_asm.S */
+
+static struct process Procs[PROC_MAX];	/* forked ones, free while pml4 is NULL */
+static struct process *First;
+static int NextPid = 1;
+
+static long exit_call(long a1, long a2, long a3, long a4, long a5)
+{
+	sys_exit(a1);
+	return -1;
+}
+
+static long wait_call(long a1, long a2, long a3, long a4, long a5)
+{
+	return sys_wait(a1);
+}
+
+void sched_init(struct process *init)
+{
+	init->pid = NextPid++;
+	init->state = PROC_RUNNABLE;
+	init->kstack_top = kernel_stack;
+	First = init;
+
+	syscall_register(SYS_FORK, "fork", NULL);
+	syscall_register(SYS_EXIT, "exit", exit_call);
+	syscall_register(SYS_WAIT, "wait", wait_call);
+}
+
+static void switch_to(struct process *next)
+{
+	struct process *prev = current_process;
+
+	if (next == prev)
+		return;
+	prev->ustack = user_stack;
+	user_stack = next->ustack;
+	kernel_stack = next->kstack_top;
+	trap_set_kernel_stack(next->kstack_top);
+	proc_switch(next);
+	vdso_update();
+	context_switch(&prev->ksp, next->ksp);
+}
+
+/* Runs the next runnable process after the current one, round robin */
+static void schedule(void)
+{
+	struct process *p = current_process;
+
+	do {
+		p = p->next != NULL ? p->next : First;
+		if (p->state == PROC_RUNNABLE) {
+			switch_to(p);
+			return;
+		}
+	} while (p != current_process);
+
+	printf("No runnable process left\n");
+	kernel_idle();
+}
+
+long sys_fork(const uint64_t *frame)
+{
+	struct process *parent = current_process, *child = NULL;
+	uint64_t *ksp;
+	void *kstack;
+	size_t i;
+
+	for (i = 0; i < PROC_MAX && child == NULL; i++) {
+		if (Procs[i].pml4 == NULL)
+			child = &Procs[i];
+	}
+	if (parent == NULL || child == NULL)
+		return -1;
+	kstack = alloc_pages(KSTACK_ORDER);
+	if (kstack == NULL)
+		return -1;
+	if (proc_fork(child, parent, true) < 0) {
+		free_pages(kstack, KSTACK_ORDER);
+		return -1;
+	}
+
+	/*
+	 * context_switch() pops SWITCH_WORDS (any values) and returns to
+	 * fork_return, which restores the user registers from the frame
+	 */
+	child->kstack = kstack;
+	child->kstack_top = (char *) kstack + (PAGE_SIZE << KSTACK_ORDER);
+	ksp = (uint64_t *) child->kstack_top - FORK_FRAME_WORDS;
+	memcpy(ksp, frame, FORK_FRAME_WORDS * sizeof(uint64_t));
+	*--ksp = (uint64_t) fork_return;
+	ksp -= SWITCH_WORDS;
+	child->ksp = (uint64_t) ksp;
+	child->ustack = user_stack;
+
+	child->pid = NextPid++;
+	child->state = PROC_RUNNABLE;
+	child->parent = parent;
+	child->next = parent->next;
+	parent->next = child;
+	return child->pid;
+}
+
+void sys_exit(long code)
+{
+	struct process *p = current_process, *q;
+
+	/* Orphans are left to the init process */
+	for (q = First; q != NULL; q = q->next) {
+		if (q->parent == p)
+			q->parent = First;
+	}
+	p->exit_code = code;
+	p->state = PROC_ZOMBIE;
+	if (p->parent != NULL && p->parent->state == PROC_WAITING)
+		p->parent->state = PROC_RUNNABLE;
+	schedule();
+}
+
+/* Frees an exited child, the current process is its parent */
+static void reap(struct process *child)
+{
+	struct process *q;
+
+	for (q = First; q->next != child; q = q->next)
+		;
+	q->next = child->next;
+	free_pages(child->kstack, KSTACK_ORDER);
+	proc_destroy(child);
+}
+
+long sys_wait(long pid)
+{
+	struct process *p = current_process, *q;
+	bool found;
+	long code;
+
+	while (1) {
+		found = false;
+		for (q = First; q != NULL; q = q->next) {
+			if (q->parent != p || (pid != -1 && q->pid != pid))
+				continue;
+			if (q->state == PROC_ZOMBIE) {
+				code = q->exit_code & 0xFF;
+				reap(q);
+				return code;
+			}
+			found = true;
+		}
+		if (!found)
+			return -1;
+		/* The caller is blocked anyway, top the zeroed frames up */
+		p->state = PROC_WAITING;
+		page_zero_refill(ZERO_REFILL_BATCH);
+		schedule();
+	}
+}
@@ -0,0 +1,124 @@
+/*
+ * syscall.c - the system call table
+ *
+ * syscall_entry_asm (kernel_asm.S) calls syscall_entry() with the number
+ * and up to five arguments, which indexes a table of handlers that the
+ * subsystems register at boot. Handler addresses are stored at run time:
+ * the kernel is linked without relocations.
+ */
+
+#include <syscall.h>
+#include <kernel.h>
+#include <cpu.h>
+#include <page_alloc.h>
+#include <printf.h>
+#include <proc.h>
+#include <ring.h>
+#include <sched.h>
+#include <timeline.h>
+
+static struct syscall_slot Syscalls[SYSCALL_MAX];
+
+void syscall_register(long nr, const char *name, syscall_handler_t handler)
+{
+	if (nr < 0 || nr >= SYSCALL_MAX) {
+		printf("ERROR: system call %ld (%s) is out of range\n", nr, name);
+		return;
+	}
+	Syscalls[nr].handler = handler;
+	Syscalls[nr].name = name;
+}
+
+static inline void account(struct syscall_slot *s, uint64_t start)
+{
+	uint64_t cycles = rdtsc() - start;
+
+	s->cycles += cycles;
+	if (cycles > s->max_cycles)
+		s->max_cycles = cycles;
+}
+
+long syscall_call(long n, long a1, long a2, long a3, long a4, long a5)
+{
+	struct syscall_slot *s;
+	uint64_t start;
+	long ret;
+
+	if ((unsigned long) n >= SYSCALL_MAX || Syscalls[n].handler == NULL)
+		return -1;
+	s = &Syscalls[n];
+	/* Counted up front, exit() does not come back */
+	s->calls++;
+	start = rdtsc();
+	ret = s->handler(a1, a2, a3, a4, a5);
+	account(s, start);
+	return ret;
+}
+
+long syscall_entry(long n, long a1, long a2, long a3, long a4, long a5)
+{
+	long ret;
+
+	timeline_mark("user_start");
+	timeline_print();
+	if (current_process != NULL && (current_process->ring_flags & RING_POLL))
+		ring_poll(current_process);
+	ret = syscall_call(n, a1, a2, a3, a4, a5);
+	/* The call is done, the time is not counted against it */
+	page_zero_top_up();
+	return ret;
+}
+
+long syscall_fork(const uint64_t *frame)
+{
+	struct syscall_slot *s = &Syscalls[SYS_FORK];
+	uint64_t start;
+	long ret;
+
+	s->calls++;
+	start = rdtsc();
+	ret = sys_fork(frame);
+	account(s, start);
+	return ret;
+}
+
+void syscall_stats_dump(bool reset)
+{
+	uint64_t total = 0;
+	size_t nr;
+
+	for (nr = 0; nr < SYSCALL_MAX; nr++)
+		total += Syscalls[nr].cycles;
+	printf("System calls (cycles: average, maximum, share of the total):\n");
+	for (nr = 0; nr < SYSCALL_MAX; nr++) {
+		struct syscall_slot *s = &Syscalls[nr];
+
+		if (s->calls == 0)
+			continue;
+		printf("%5zu %-14s %8llu calls %10llu avg %10llu max %3llu%%\n", nr,
+			s->name ? s->name : "?", s->calls, s->cycles / s->calls, s->max_cycles,
+			total ? s->cycles * 100 / total : 0);
+		if (reset) {
+			s->calls = 0;
+			s->cycles = 0;
+			s->max_cycles = 0;
+		}
+	}
+}
+
+static long syscall_stats(long reset, long a2, long a3, long a4, long a5)
+{
+	syscall_stats_dump(reset != 0);
+	return 0;
+}
+
+static long syscall_nop(long a1, long a2, long a3, long a4, long a5)
+{
+	return 0;
+}
+
+void syscall_table_init(void)
+{
+	syscall_register(SYS_SYSCALL_STATS, "syscall_stats", syscall_stats);
+	syscall_register(SYS_NOP, "nop", syscall_nop);
+}
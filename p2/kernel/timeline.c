@@ -0,0 +1,73 @@
+/*
+ * timeline.c - boot phase timestamps from efi_main() to the first syscall
+ */
+
+#include <timeline.h>
+#include <cpu.h>
+#include <printf.h>
+
+#define TIMELINE_MAX	(BOOT_MARKS_MAX + 16)
+
+static boot_mark_t Marks[TIMELINE_MAX];
+static size_t NumMarks = 0;
+static uint64_t TscKhz = 0;
+static uint32_t MapRetries = 0;
+static int Printed = 0;
+
+void timeline_init(const boot_info_t *bi)
+{
+	uint32_t i;
+
+	TscKhz = bi->tsc_khz;
+	MapRetries = bi->map_retries;
+	for (i = 0; i < bi->mark_count && i < BOOT_MARKS_MAX; i++)
+		Marks[NumMarks++] = bi->marks[i];
+}
+
+void timeline_mark(const char *name)
+{
+	boot_mark_t *mark;
+	size_t i;
+
+	if (Printed || NumMarks == TIMELINE_MAX)
+		return;
+	mark = &Marks[NumMarks++];
+	mark->tsc = rdtsc();
+	for (i = 0; i < BOOT_MARK_NAME_MAX - 1 && name[i] != '\0'; i++)
+		mark->name[i] = name[i];
+	mark->name[i] = '\0';
+}
+
+uint64_t timeline_tsc_khz(void)
+{
+	return TscKhz;
+}
+
+static uint64_t tsc_to_us(uint64_t ticks)
+{
+	return ticks * 1000 / TscKhz;
+}
+
+void timeline_print(void)
+{
+	size_t i;
+
+	if (Printed || NumMarks == 0)
+		return;
+	Printed = 1;
+
+	if (TscKhz == 0) {
+		/* Not calibrated, report raw cycles */
+		printf("Boot timeline (TSC cycles, %u memory map retries):\n", MapRetries);
+		for (i = 1; i < NumMarks; i++)
+			printf("%12llu  +%-12llu %s\n", Marks[i].tsc - Marks[0].tsc,
+				Marks[i].tsc - Marks[i - 1].tsc, Marks[i].name);
+		return;
+	}
+
+	printf("Boot timeline (us, TSC at %llu kHz, %u memory map retries):\n",
+		TscKhz, MapRetries);
+	for (i = 1; i < NumMarks; i++)
+		printf("%9llu  +%-9llu %s\n", tsc_to_us(Marks[i].tsc - Marks[0].tsc),
+			tsc_to_us(Marks[i].tsc - Marks[i - 1].tsc), Marks[i].name);
+}
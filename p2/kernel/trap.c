@@ -0,0 +1,146 @@
+/*
+ * trap.c - the IDT, the TSS and exception dispatch
+ */
+
+#include <trap.h>
+#include <kernel.h>
+#include <msr.h>
+#include <cpu.h>
+#include <fault.h>
+#include <printf.h>
+#include <string.h>
+
+#define GDT_TSS		0x28	/* a 16-byte descriptor after the USER code one */
+#define TRAP_STUB_SIZE	16	/* see TRAP_STUB in kernel_asm.S */
+#define IDT_INTERRUPT	0x8E	/* present, DPL 0, 64-bit interrupt gate (IF = 0) */
+#define IST_STACK_SIZE	4096
+#define IST_STACKS	4	/* #DF, NMI, #DB, #MC */
+
+struct idt_gate {
+	uint16_t offset_low;
+	uint16_t selector;
+	uint8_t ist;
+	uint8_t type;
+	uint16_t offset_mid;
+	uint32_t offset_high;
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct tss {
+	uint32_t reserved0;
+	uint64_t rsp[3];
+	uint64_t reserved1;
+	uint64_t ist[7];
+	uint64_t reserved2;
+	uint16_t reserved3;
+	uint16_t iomap_base;
+} __attribute__((packed));
+
+struct table_ptr {
+	uint16_t limit;
+	uint64_t base;
+} __attribute__((packed));
+
+extern uint64_t gdt[];		/* kernel_entry.S */
+extern char trap_stubs[];	/* kernel_asm.S */
+
+static struct idt_gate Idt[TRAP_VECTORS] __attribute__((aligned(16)));
+static struct tss Tss __attribute__((aligned(16)));
+static uint8_t IstStacks[IST_STACKS][IST_STACK_SIZE] __attribute__((aligned(16)));
+
+/* No pointer tables: the kernel is not relocated */
+static const char TrapNames[TRAP_VECTORS][4] = {
+	"#DE", "#DB", "NMI", "#BP", "#OF", "#BR", "#UD", "#NM",
+	"#DF", "CSO", "#TS", "#NP", "#SS", "#GP", "#PF", "#15",
+	"#MF", "#AC", "#MC", "#XM", "#VE", "#CP", "#22", "#23",
+	"#24", "#25", "#26", "#27", "#HV", "#VC", "#SX", "#31"
+};
+
+/* The IST stack of a vector (1 .. IST_STACKS), 0: the current or the TSS rsp[0] one */
+static uint8_t trap_ist(unsigned int vec)
+{
+	switch (vec) {
+	case TRAP_DF:
+		return 1;
+	case TRAP_NMI:
+		return 2;
+	case TRAP_DB:
+		return 3;
+	case TRAP_MC:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static void set_gate(unsigned int vec, uint64_t handler, uint8_t ist)
+{
+	struct idt_gate *g = &Idt[vec];
+
+	g->offset_low = (uint16_t) handler;
+	g->selector = GDT_KERNEL_CODE;
+	g->ist = ist;
+	g->type = IDT_INTERRUPT;
+	g->offset_mid = (uint16_t) (handler >> 16);
+	g->offset_high = (uint32_t) (handler >> 32);
+	g->reserved = 0;
+}
+
+static void tss_init(void)
+{
+	uint64_t base = (uint64_t) &Tss, limit = sizeof(Tss) - 1;
+	unsigned int i;
+
+	memset(&Tss, 0, sizeof(Tss));
+	Tss.rsp[0] = (uint64_t) kernel_stack;
+	for (i = 0; i < IST_STACKS; i++)
+		Tss.ist[i] = (uint64_t) (IstStacks[i] + IST_STACK_SIZE);
+	Tss.iomap_base = sizeof(Tss);	/* no I/O permission bitmap */
+
+	/* A 64-bit available TSS (type 9), present */
+	gdt[GDT_TSS / 8] = (limit & 0xFFFF) | ((base & 0xFFFFFF) << 16) | (0x89ULL << 40) |
+		((limit & 0xF0000) << 32) | ((base & 0xFF000000) << 32);
+	gdt[GDT_TSS / 8 + 1] = base >> 32;
+	__asm__ __volatile__ ("ltr %w0" : : "r" (GDT_TSS));
+}
+
+void trap_init(void)
+{
+	struct table_ptr idtr;
+	unsigned int vec;
+
+	/* Absolute addresses are computed at run time (no relocations) */
+	for (vec = 0; vec < TRAP_VECTORS; vec++)
+		set_gate(vec, (uint64_t) (trap_stubs + vec * TRAP_STUB_SIZE), trap_ist(vec));
+	idtr.limit = sizeof(Idt) - 1;
+	idtr.base = (uint64_t) Idt;
+	__asm__ __volatile__ ("lidt %0" : : "m" (idtr));
+
+	tss_init();
+}
+
+void trap_set_kernel_stack(void *top)
+{
+	Tss.rsp[0] = (uint64_t) top;
+}
+
+static void trap_dump(const struct trap_frame *tf)
+{
+	printf("ERROR: %s (vector %zu, error %llx) at rip %p, %s mode\n",
+		TrapNames[tf->vector], (size_t) tf->vector, tf->error,
+		(void *) tf->rip, (tf->cs & 3) ? "user" : "kernel");
+	printf("rsp %p rflags %llx rax %llx rdi %llx rsi %llx\n", (void *) tf->rsp,
+		tf->rflags, tf->rax, tf->rdi, tf->rsi);
+	if (tf->vector == TRAP_PF)
+		printf("Faulting address %p\n", (void *) read_cr2());
+}
+
+void trap_entry(struct trap_frame *tf)
+{
+	if (tf->vector == TRAP_PF && fault_handle(tf))
+		return;
+
+	/* Nothing can be recovered otherwise, not even a faulting user process */
+	trap_dump(tf);
+	while (1) {};
+}
@@ -0,0 +1,115 @@
+/*
+ * vdso.c - the kernel data page that user space reads without system calls
+ *
+ * One frame, written by the kernel through the identity map and mapped
+ * read-only (and no-execute) at USER_VDSO_VA. Every new address space
+ * gets it as a region (proc_create()), fork() shares it like any
+ * read-only page; the kernel keeps a reference of its own so that it
+ * outlives every process.
+ */
+
+#include <vdso.h>
+#include <kernel.h>
+#include <cpu.h>
+#include <numa.h>
+#include <page_alloc.h>
+#include <paging.h>
+#include <string.h>
+#include <syscall.h>
+#include <timeline.h>
+#include <user_layout.h>
+#include <vm.h>
+
+#define VDSO_FLAGS	(PTE_U | PTE_NX)
+
+struct vdso_data *vdso_page = NULL;
+
+_Static_assert(__builtin_offsetof(struct vdso_data, status) == VDSO_STATUS &&
+	       __builtin_offsetof(struct vdso_data, cpu) == VDSO_CPU &&
+	       __builtin_offsetof(struct vdso_data, ns_mult) == VDSO_NS_MULT &&
+	       __builtin_offsetof(struct vdso_data, clock_tsc) == VDSO_CLOCK_TSC &&
+	       __builtin_offsetof(struct vdso_data, clock_ns) == VDSO_CLOCK_NS,
+	       "kernel_asm.S reads struct vdso_data at the wrong offsets");
+
+static inline void barrier(void)
+{
+	__asm__ __volatile__ ("" : : : "memory");
+}
+
+static uint64_t tsc_to_ns(uint64_t ticks)
+{
+	return (uint64_t) (((unsigned __int128) ticks * vdso_page->ns_mult) >> vdso_page->ns_shift);
+}
+
+void vdso_update(void)
+{
+	uint64_t tsc;
+
+	if (vdso_page == NULL)
+		return;
+	/* Readers retry while 'seq' is odd or has changed under them */
+	*(volatile uint32_t *) &vdso_page->seq = vdso_page->seq + 1;
+	barrier();
+	tsc = rdtsc();
+	vdso_page->status = kernel_status;
+	vdso_page->cpu = cpu_apic_id();
+	vdso_page->node = numa_local_node();
+	vdso_page->clock_ns += tsc_to_ns(tsc - vdso_page->clock_tsc);
+	vdso_page->clock_tsc = tsc;
+	barrier();
+	*(volatile uint32_t *) &vdso_page->seq = vdso_page->seq + 1;
+}
+
+int vdso_init(void)
+{
+	uint64_t khz = timeline_tsc_khz();
+
+	/* The first reference is the kernel's own */
+	vdso_page = alloc_zeroed_page();
+	if (vdso_page == NULL)
+		return -1;
+	vdso_page->version = VDSO_VERSION;
+	vdso_page->tsc_khz = khz;
+	vdso_page->ns_shift = VDSO_NS_SHIFT;
+	vdso_page->ns_mult = khz != 0 ? (1000000ULL << VDSO_NS_SHIFT) / khz : 0;
+	/* The clock counts from the TSC reset (power-on) */
+	vdso_update();
+	return 0;
+}
+
+int vdso_map(struct process *p)
+{
+	if (proc_add_region(p, USER_VDSO_VA, PAGE_SIZE, VDSO_FLAGS) < 0)
+		return -1;
+	/* The mapping's reference, dropped when the region goes */
+	page_get(vdso_page);
+	if (vm_map_range(p->pml4, USER_VDSO_VA, (uint64_t) vdso_page, PAGE_SIZE, VDSO_FLAGS) < 0) {
+		page_put(vdso_page);
+		return -1;
+	}
+	return 0;
+}
+
+/* What kernel_asm.S computes for SYS_CLOCK_NS */
+static long sys_clock_ns(long a1, long a2, long a3, long a4, long a5)
+{
+	return vdso_page->clock_ns + tsc_to_ns(rdtsc() - vdso_page->clock_tsc);
+}
+
+static long sys_cpu_id(long a1, long a2, long a3, long a4, long a5)
+{
+	return cpu_apic_id();
+}
+
+static long sys_yield_hint(long a1, long a2, long a3, long a4, long a5)
+{
+	__asm__ __volatile__ ("pause");
+	return 0;
+}
+
+void vdso_syscalls_init(void)
+{
+	syscall_register(SYS_CLOCK_NS, "clock_ns", sys_clock_ns);
+	syscall_register(SYS_CPU_ID, "cpu_id", sys_cpu_id);
+	syscall_register(SYS_YIELD_HINT, "yield_hint", sys_yield_hint);
+}
@@ -0,0 +1,439 @@
+/*
+ * vm.c - mapping, unmapping and protecting ranges of virtual memory
+ */
+
+#include <vm.h>
+#include <cpu.h>
+#include <msr.h>
+#include <page_alloc.h>
+#include <string.h>
+
+/* Level 1 is the page table, 4 is the PML4 */
+#define LEVEL_SHIFT(level)	(12 + 9 * ((level) - 1))
+#define LEVEL_SIZE(level)	(1ULL << LEVEL_SHIFT(level))
+
+/* Attribute bits that callers may set; PS, and PAT in large pages, are ours */
+#define ATTR_MASK	(~(PTE_ADDR_MASK | PTE_P | PTE_PS | VM_SMALL_PAGES))
+/* Intermediate entries inherit these from the leaves below them */
+#define TABLE_ATTRS	(PTE_W | PTE_U)
+
+static int MaxLevel = 0;	/* the largest leaf level, 0 until probed */
+static uint64_t AttrMask = ATTR_MASK & ~PTE_NX;	/* PTE_NX once EFER.NXE is on */
+static struct vm_stats Stats;
+
+static struct {
+	int depth;
+	bool full;		/* too many pages, reload CR3 instead */
+	bool global;		/* a global entry changed */
+	size_t count;
+	uint64_t va[VM_FLUSH_MAX];
+} Batch;
+
+static inline size_t level_index(uint64_t va, int level)
+{
+	return (va >> LEVEL_SHIFT(level)) & (PT_ENTRIES - 1);
+}
+
+static int max_level(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	if (MaxLevel == 0) {
+		MaxLevel = 2;
+		if (cpuid_max_extended() >= 0x80000001) {
+			cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+			if (edx & CPUID_80000001_EDX_PAGE1GB)
+				MaxLevel = 3;
+		}
+	}
+	return MaxLevel;
+}
+
+uint64_t vm_max_page_size(void)
+{
+	return LEVEL_SIZE(max_level());
+}
+
+static uint64_t *table_alloc(void)
+{
+	uint64_t *table = alloc_page();
+
+	if (table != NULL) {
+		memset(table, 0, PAGE_SIZE);
+		Stats.tables++;
+	}
+	return table;
+}
+
+bool vm_nx_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	if (cpuid_max_extended() < 0x80000001)
+		return false;
+	cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+	if (!(edx & CPUID_80000001_EDX_NX))
+		return false;
+	wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+	AttrMask = ATTR_MASK;
+	return true;
+}
+
+void vm_global_init(void)
+{
+	write_cr4(read_cr4() | CR4_PGE);
+}
+
+void vm_flush_tlb(bool global)
+{
+	uint64_t cr4;
+
+	if (global) {
+		/* Toggling PGE drops everything, global entries and all PCIDs */
+		cr4 = read_cr4();
+		write_cr4(cr4 & ~CR4_PGE);
+		write_cr4(cr4);
+		Stats.global_flushes++;
+	} else {
+		write_cr3(read_cr3());
+		Stats.cr3_reloads++;
+	}
+}
+
+void vm_batch_begin(void)
+{
+	Batch.depth++;
+}
+
+void vm_batch_end(void)
+{
+	size_t i;
+
+	if (--Batch.depth != 0)
+		return;
+	if (Batch.full) {
+		vm_flush_tlb(Batch.global);
+	} else {
+		for (i = 0; i < Batch.count; i++)
+			invlpg(Batch.va[i]);
+		Stats.invlpgs += Batch.count;
+	}
+	Batch.count = 0;
+	Batch.full = false;
+	Batch.global = false;
+}
+
+/* 'old' is the entry that changed */
+static void invalidate(uint64_t *pml4, uint64_t va, uint64_t old)
+{
+	/*
+	 * Nothing is cached for tables that are not loaded, except for global
+	 * entries: those are the kernel's, shared by every address space
+	 */
+	if (old & PTE_G)
+		Batch.global = true;
+	else if ((uint64_t) pml4 != (read_cr3() & PTE_ADDR_MASK))
+		return;
+	if (Batch.full)
+		return;
+	if (Batch.count == VM_FLUSH_MAX)
+		Batch.full = true;
+	else
+		Batch.va[Batch.count++] = va;
+}
+
+/* Replace a large page at 'level' with a table of the next smaller pages */
+static bool split(uint64_t *pml4, uint64_t *entry, int level, uint64_t va)
+{
+	uint64_t *table = table_alloc();
+	uint64_t size = LEVEL_SIZE(level - 1);
+	uint64_t base = *entry & PTE_ADDR_MASK & ~(LEVEL_SIZE(level) - 1);
+	uint64_t attrs = *entry & ~PTE_ADDR_MASK;
+	size_t i;
+
+	if (table == NULL)
+		return false;
+	if (level - 1 == 1)
+		attrs &= ~PTE_PS;
+	for (i = 0; i < PT_ENTRIES; i++)
+		table[i] = (base + i * size) | attrs;
+	*entry = (uint64_t) table | PTE_P | (attrs & TABLE_ATTRS);
+	invalidate(pml4, va & ~(LEVEL_SIZE(level) - 1), attrs);
+	Stats.splits++;
+	return true;
+}
+
+/*
+ * The entry for 'va' at 'level': missing tables are allocated and large
+ * pages on the way are split; intermediate entries gain 'flags' permissions
+ */
+static uint64_t *walk(uint64_t *pml4, uint64_t va, int level, uint64_t flags)
+{
+	uint64_t *table = pml4;
+	int l;
+
+	for (l = 4; l > level; l--) {
+		uint64_t *entry = &table[level_index(va, l)];
+
+		if (!(*entry & PTE_P)) {
+			uint64_t *next = table_alloc();
+			if (next == NULL)
+				return NULL;
+			*entry = (uint64_t) next | PTE_P | PTE_W;
+		} else if (*entry & PTE_PS) {
+			if (!split(pml4, entry, l, va))
+				return NULL;
+		}
+		*entry |= flags & TABLE_ATTRS;
+		table = (uint64_t *) (*entry & PTE_ADDR_MASK);
+	}
+	return &table[level_index(va, level)];
+}
+
+/* The largest leaf level that fits [va, va + len) and pa */
+static int fit_level(uint64_t va, uint64_t pa, uint64_t len, uint64_t flags)
+{
+	int level = (flags & VM_SMALL_PAGES) ? 1 : max_level();
+
+	while (level > 1 && (((va | pa) & (LEVEL_SIZE(level) - 1)) != 0 || len < LEVEL_SIZE(level)))
+		level--;
+	return level;
+}
+
+int vm_map_range(uint64_t *pml4, uint64_t va, uint64_t pa, uint64_t len, uint64_t flags)
+{
+	int ret = 0;
+
+	if (((va | pa | len) & (PAGE_SIZE - 1)) != 0)
+		return -1;
+
+	vm_batch_begin();
+	while (len != 0) {
+		int level = fit_level(va, pa, len, flags);
+		uint64_t *entry = walk(pml4, va, level, flags);
+
+		/* A table is already there, keep it and use smaller pages */
+		while (entry != NULL && level > 1 && (*entry & PTE_P) && !(*entry & PTE_PS))
+			entry = walk(pml4, va, --level, flags);
+		if (entry == NULL) {
+			ret = -1;
+			break;
+		}
+
+		if (*entry & PTE_P)
+			invalidate(pml4, va, *entry);
+		*entry = pa | PTE_P | (flags & AttrMask) | (level > 1 ? PTE_PS : 0);
+		va += LEVEL_SIZE(level);
+		pa += LEVEL_SIZE(level);
+		len -= LEVEL_SIZE(level);
+	}
+	vm_batch_end();
+	return ret;
+}
+
+/* A shared copy-on-write page stays read-only whatever the new attributes */
+static uint64_t protect_entry(uint64_t entry, uint64_t flags)
+{
+	uint64_t attrs = flags & AttrMask;
+
+	if (entry & PTE_COW)
+		attrs = (attrs & ~PTE_W) | PTE_COW;
+	return (entry & (PTE_ADDR_MASK | PTE_P | PTE_PS)) | attrs;
+}
+
+/* Unmaps (unmap) or sets the attributes of the leaves covering the range */
+static int change_range(uint64_t *pml4, uint64_t va, uint64_t len, bool unmap, uint64_t flags)
+{
+	int ret = 0;
+
+	if (((va | len) & (PAGE_SIZE - 1)) != 0)
+		return -1;
+
+	vm_batch_begin();
+	while (len != 0) {
+		uint64_t *table = pml4;
+		uint64_t step = 0;
+		int level = 4;
+
+		while (step == 0) {
+			uint64_t size = LEVEL_SIZE(level);
+			uint64_t *entry = &table[level_index(va, level)];
+			/* Bytes from va to the end of this entry's range (wraps at the top) */
+			uint64_t left = size - (va & (size - 1));
+
+			if (!(*entry & PTE_P)) {
+				step = left;
+			} else if (level == 1 || (*entry & PTE_PS)) {
+				if (left != size || len < size) {
+					/* Only a part of a large page changes */
+					if (!split(pml4, entry, level, va)) {
+						ret = -1;
+						goto out;
+					}
+					continue;
+				}
+				invalidate(pml4, va, *entry);
+				if (unmap)
+					*entry = 0;
+				else
+					*entry = protect_entry(*entry, flags);
+				step = size;
+			} else {
+				if (!unmap)
+					*entry |= flags & TABLE_ATTRS;
+				table = (uint64_t *) (*entry & PTE_ADDR_MASK);
+				level--;
+			}
+		}
+		if (step >= len)
+			break;
+		va += step;
+		len -= step;
+	}
+out:
+	vm_batch_end();
+	return ret;
+}
+
+int vm_unmap_range(uint64_t *pml4, uint64_t va, uint64_t len)
+{
+	return change_range(pml4, va, len, true, 0);
+}
+
+int vm_protect(uint64_t *pml4, uint64_t va, uint64_t len, uint64_t flags)
+{
+	return change_range(pml4, va, len, false, flags);
+}
+
+uint64_t vm_lookup(uint64_t *pml4, uint64_t va, uint64_t *size)
+{
+	uint64_t *table = pml4;
+	int level;
+
+	for (level = 4; level >= 1; level--) {
+		uint64_t entry = table[level_index(va, level)];
+
+		if (size != NULL)
+			*size = LEVEL_SIZE(level);
+		if (!(entry & PTE_P))
+			return 0;
+		if (level == 1 || (entry & PTE_PS))
+			return entry;
+		table = (uint64_t *) (entry & PTE_ADDR_MASK);
+	}
+	return 0;
+}
+
+static void free_table(uint64_t *table, int level)
+{
+	size_t i;
+
+	if (level > 1) {
+		for (i = 0; i < PT_ENTRIES; i++) {
+			if ((table[i] & PTE_P) && !(table[i] & PTE_PS))
+				free_table((uint64_t *) (table[i] & PTE_ADDR_MASK), level - 1);
+		}
+	}
+	free_page(table);
+	Stats.tables_freed++;
+}
+
+void vm_free_tables(uint64_t *pml4, size_t first, size_t end)
+{
+	size_t i;
+
+	for (i = first; i < end; i++) {
+		if (pml4[i] & PTE_P)
+			free_table((uint64_t *) (pml4[i] & PTE_ADDR_MASK), 3);
+		pml4[i] = 0;
+	}
+}
+
+/* A private copy of the frames behind a leaf, NULL if out of memory */
+static void *copy_frames(uint64_t entry, uint64_t size)
+{
+	void *block = alloc_pages(page_order(size));
+
+	if (block != NULL)
+		memcpy(block, (void *) (entry & PTE_ADDR_MASK & ~(size - 1)), size);
+	return block;
+}
+
+/*
+ * Duplicates the 'src' entry for 'va' at 'level' into 'dst' (empty or a
+ * table), see vm_copy_tables()
+ */
+static int copy_entry(uint64_t *spml4, uint64_t *dst, uint64_t *src, int level,
+		      uint64_t va, bool cow)
+{
+	uint64_t entry = *src, size = LEVEL_SIZE(level);
+	uint64_t *dtable, *stable;
+	void *frames;
+	size_t i;
+
+	if (!(entry & PTE_P))
+		return 0;
+
+	/* Frames are shared one by one */
+	if (cow && level > 1 && (entry & PTE_PS)) {
+		if (!split(spml4, src, level, va))
+			return -1;
+		entry = *src;
+	}
+
+	if (level > 1 && !(entry & PTE_PS)) {
+		dtable = (uint64_t *) (*dst & PTE_ADDR_MASK);
+		if (!(*dst & PTE_P)) {
+			dtable = table_alloc();
+			if (dtable == NULL)
+				return -1;
+		}
+		*dst = (uint64_t) dtable | (entry & ~PTE_ADDR_MASK);
+		stable = (uint64_t *) (entry & PTE_ADDR_MASK);
+		for (i = 0; i < PT_ENTRIES; i++) {
+			if (copy_entry(spml4, &dtable[i], &stable[i], level - 1,
+				       va + i * LEVEL_SIZE(level - 1), cow) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	if (cow && page_get((void *) (entry & PTE_ADDR_MASK))) {
+		if (entry & PTE_W) {
+			invalidate(spml4, va, entry);
+			entry = (entry & ~PTE_W) | PTE_COW;
+			*src = entry;
+		}
+		*dst = entry;
+		return 0;
+	}
+
+	/* An eager copy, or a frame that cannot be shared (the loaded image) */
+	frames = copy_frames(entry, size);
+	if (frames == NULL)
+		return -1;
+	*dst = (uint64_t) frames | (entry & ~PTE_ADDR_MASK);
+	return 0;
+}
+
+int vm_copy_tables(uint64_t *dst, uint64_t *src, size_t first, size_t end, bool cow)
+{
+	int ret = 0;
+	size_t i;
+
+	vm_batch_begin();
+	for (i = first; i < end && ret == 0; i++) {
+		/* Canonical addresses: the upper half is sign-extended */
+		uint64_t va = ((uint64_t) i << LEVEL_SHIFT(4)) |
+			(i >= PT_ENTRIES / 2 ? 0xFFFF000000000000ULL : 0);
+
+		ret = copy_entry(src, &dst[i], &src[i], 4, va, cow);
+	}
+	vm_batch_end();
+	return ret;
+}
+
+void vm_stats(struct vm_stats *stats)
+{
+	*stats = Stats;
+}
@@ -0,0 +1,498 @@
+/*
+ * vma.c - an augmented red-black tree of virtual memory areas
+ *
+ * The tree follows CLRS with NULL leaves. 'subtree_gap' is recomputed
+ * bottom-up on every path that changes: rotations fix their two nodes,
+ * links, unlinks and gap changes propagate to the root.
+ */
+
+#include <vma.h>
+#include <paging.h>
+#include <page_alloc.h>
+
+/* Areas are carved out of whole pages and cached once freed */
+static struct vma *FreeAreas = NULL;
+
+static struct vma *area_alloc(void)
+{
+	struct vma *v;
+	size_t i;
+
+	if (FreeAreas == NULL) {
+		v = alloc_page();
+		if (v == NULL)
+			return NULL;
+		for (i = 0; i < PAGE_SIZE / sizeof(*v); i++) {
+			v[i].right = FreeAreas;
+			FreeAreas = &v[i];
+		}
+	}
+	v = FreeAreas;
+	FreeAreas = v->right;
+	return v;
+}
+
+static void area_free(struct vma *v)
+{
+	v->right = FreeAreas;
+	FreeAreas = v;
+}
+
+static void update(struct vma *v)
+{
+	uint64_t gap = v->gap;
+
+	if (v->left != NULL && v->left->subtree_gap > gap)
+		gap = v->left->subtree_gap;
+	if (v->right != NULL && v->right->subtree_gap > gap)
+		gap = v->right->subtree_gap;
+	v->subtree_gap = gap;
+}
+
+static void propagate(struct vma *v)
+{
+	for (; v != NULL; v = v->parent)
+		update(v);
+}
+
+/* Recomputes the gap below 'v' after its predecessor changed */
+static void refresh_gap(struct vma *v)
+{
+	struct vma *prev;
+
+	if (v == NULL)
+		return;
+	prev = vma_prev(v);
+	v->gap = v->start - (prev != NULL ? prev->end : 0);
+	propagate(v);
+}
+
+static void replace_child(struct vma_tree *t, struct vma *old, struct vma *new)
+{
+	if (old->parent == NULL)
+		t->root = new;
+	else if (old == old->parent->left)
+		old->parent->left = new;
+	else
+		old->parent->right = new;
+	if (new != NULL)
+		new->parent = old->parent;
+}
+
+static void rotate_left(struct vma_tree *t, struct vma *x)
+{
+	struct vma *y = x->right;
+
+	x->right = y->left;
+	if (y->left != NULL)
+		y->left->parent = x;
+	replace_child(t, x, y);
+	y->left = x;
+	x->parent = y;
+	update(x);
+	update(y);
+}
+
+static void rotate_right(struct vma_tree *t, struct vma *x)
+{
+	struct vma *y = x->left;
+
+	x->left = y->right;
+	if (y->right != NULL)
+		y->right->parent = x;
+	replace_child(t, x, y);
+	y->right = x;
+	x->parent = y;
+	update(x);
+	update(y);
+}
+
+static bool is_red(const struct vma *v)
+{
+	return v != NULL && v->red;
+}
+
+static void insert_fixup(struct vma_tree *t, struct vma *z)
+{
+	while (is_red(z->parent)) {
+		struct vma *p = z->parent, *g = p->parent, *u;
+
+		if (p == g->left) {
+			u = g->right;
+			if (is_red(u)) {
+				p->red = u->red = false;
+				g->red = true;
+				z = g;
+				continue;
+			}
+			if (z == p->right) {
+				rotate_left(t, p);
+				z = p;
+				p = z->parent;
+			}
+			p->red = false;
+			g->red = true;
+			rotate_right(t, g);
+		} else {
+			u = g->left;
+			if (is_red(u)) {
+				p->red = u->red = false;
+				g->red = true;
+				z = g;
+				continue;
+			}
+			if (z == p->left) {
+				rotate_right(t, p);
+				z = p;
+				p = z->parent;
+			}
+			p->red = false;
+			g->red = true;
+			rotate_left(t, g);
+		}
+	}
+	t->root->red = false;
+}
+
+/* 'x' (possibly NULL) under 'xp' carries an extra black */
+static void erase_fixup(struct vma_tree *t, struct vma *x, struct vma *xp)
+{
+	while (x != t->root && !is_red(x)) {
+		struct vma *w;
+
+		if (x == xp->left) {
+			w = xp->right;
+			if (w->red) {
+				w->red = false;
+				xp->red = true;
+				rotate_left(t, xp);
+				w = xp->right;
+			}
+			if (!is_red(w->left) && !is_red(w->right)) {
+				w->red = true;
+				x = xp;
+				xp = x->parent;
+				continue;
+			}
+			if (!is_red(w->right)) {
+				w->left->red = false;
+				w->red = true;
+				rotate_right(t, w);
+				w = xp->right;
+			}
+			w->red = xp->red;
+			xp->red = false;
+			w->right->red = false;
+			rotate_left(t, xp);
+		} else {
+			w = xp->left;
+			if (w->red) {
+				w->red = false;
+				xp->red = true;
+				rotate_right(t, xp);
+				w = xp->left;
+			}
+			if (!is_red(w->left) && !is_red(w->right)) {
+				w->red = true;
+				x = xp;
+				xp = x->parent;
+				continue;
+			}
+			if (!is_red(w->left)) {
+				w->right->red = false;
+				w->red = true;
+				rotate_left(t, w);
+				w = xp->left;
+			}
+			w->red = xp->red;
+			xp->red = false;
+			w->left->red = false;
+			rotate_right(t, xp);
+		}
+		x = t->root;
+	}
+	if (x != NULL)
+		x->red = false;
+}
+
+void vma_tree_init(struct vma_tree *t)
+{
+	t->root = NULL;
+	t->count = 0;
+}
+
+static void destroy(struct vma *v)
+{
+	while (v != NULL) {
+		struct vma *right = v->right;
+		destroy(v->left);
+		area_free(v);
+		v = right;
+	}
+}
+
+void vma_tree_destroy(struct vma_tree *t)
+{
+	destroy(t->root);
+	vma_tree_init(t);
+}
+
+struct vma *vma_lower_bound(const struct vma_tree *t, uint64_t addr)
+{
+	struct vma *v = t->root, *best = NULL;
+
+	while (v != NULL) {
+		if (v->end > addr) {
+			best = v;
+			v = v->left;
+		} else {
+			v = v->right;
+		}
+	}
+	return best;
+}
+
+struct vma *vma_find(const struct vma_tree *t, uint64_t addr)
+{
+	struct vma *v = vma_lower_bound(t, addr);
+	return (v != NULL && v->start <= addr) ? v : NULL;
+}
+
+struct vma *vma_first(const struct vma_tree *t)
+{
+	struct vma *v = t->root;
+
+	while (v != NULL && v->left != NULL)
+		v = v->left;
+	return v;
+}
+
+struct vma *vma_next(const struct vma *v)
+{
+	if (v->right != NULL) {
+		v = v->right;
+		while (v->left != NULL)
+			v = v->left;
+		return (struct vma *) v;
+	}
+	while (v->parent != NULL && v == v->parent->right)
+		v = v->parent;
+	return v->parent;
+}
+
+struct vma *vma_prev(const struct vma *v)
+{
+	if (v->left != NULL) {
+		v = v->left;
+		while (v->right != NULL)
+			v = v->right;
+		return (struct vma *) v;
+	}
+	while (v->parent != NULL && v == v->parent->left)
+		v = v->parent;
+	return v->parent;
+}
+
+struct vma *vma_insert(struct vma_tree *t, uint64_t start, uint64_t end, uint64_t flags)
+{
+	struct vma *next = vma_lower_bound(t, start), *parent = NULL, **link = &t->root;
+	struct vma *v;
+
+	if (end <= start || (next != NULL && next->start < end))
+		return NULL;
+	v = area_alloc();
+	if (v == NULL)
+		return NULL;
+
+	while (*link != NULL) {
+		parent = *link;
+		link = start < parent->start ? &parent->left : &parent->right;
+	}
+	v->parent = parent;
+	v->left = v->right = NULL;
+	v->red = true;
+	v->start = start;
+	v->end = end;
+	v->flags = flags;
+	*link = v;
+	t->count++;
+
+	refresh_gap(v);
+	refresh_gap(next);
+	insert_fixup(t, v);
+	return v;
+}
+
+void vma_remove(struct vma_tree *t, struct vma *z)
+{
+	struct vma *next = vma_next(z), *y = z, *x, *xp;
+	bool y_red = z->red;
+
+	if (z->left == NULL) {
+		x = z->right;
+		xp = z->parent;
+		replace_child(t, z, x);
+	} else if (z->right == NULL) {
+		x = z->left;
+		xp = z->parent;
+		replace_child(t, z, x);
+	} else {
+		/* The successor takes the place of z */
+		y = next;
+		y_red = y->red;
+		x = y->right;
+		if (y->parent == z) {
+			xp = y;
+		} else {
+			xp = y->parent;
+			replace_child(t, y, x);
+			y->right = z->right;
+			y->right->parent = y;
+		}
+		replace_child(t, z, y);
+		y->left = z->left;
+		y->left->parent = y;
+		y->red = z->red;
+	}
+	/* Every node whose subtree changed is on the way up from xp */
+	propagate(xp);
+	t->count--;
+	area_free(z);
+
+	refresh_gap(next);
+	if (!y_red)
+		erase_fixup(t, x, xp);
+}
+
+struct vma *vma_split(struct vma_tree *t, struct vma *v, uint64_t addr)
+{
+	uint64_t end = v->end;
+	struct vma *upper;
+
+	if (addr <= v->start || addr >= end)
+		return NULL;
+	v->end = addr;
+	upper = vma_insert(t, addr, end, v->flags);
+	if (upper == NULL)
+		v->end = end;
+	return upper;
+}
+
+struct vma *vma_merge(struct vma_tree *t, struct vma *v)
+{
+	struct vma *prev = vma_prev(v), *next = vma_next(v);
+
+	if (next != NULL && next->start == v->end && next->flags == v->flags) {
+		v->end = next->end;
+		vma_remove(t, next);	/* keeps the gap above, it did not move */
+	}
+	if (prev != NULL && prev->end == v->start && prev->flags == v->flags) {
+		prev->end = v->end;
+		vma_remove(t, v);
+		v = prev;
+	}
+	return v;
+}
+
+/* The lowest aligned fit in [gap_start, gap_end) clipped to [lo, hi), 0 if none */
+static uint64_t fit(uint64_t gap_start, uint64_t gap_end, uint64_t lo, uint64_t hi,
+		    uint64_t len, uint64_t align)
+{
+	uint64_t start;
+
+	if (gap_start < lo)
+		gap_start = lo;
+	if (gap_end > hi)
+		gap_end = hi;
+	start = (gap_start + align - 1) & ~(align - 1);
+	if (start < gap_start || start >= gap_end || gap_end - start < len)
+		return 0;
+	return start;
+}
+
+/* In address order, skipping subtrees without a large enough gap */
+static uint64_t search(const struct vma *v, uint64_t lo, uint64_t hi, uint64_t len,
+		       uint64_t align, bool *past)
+{
+	uint64_t addr;
+
+	while (v != NULL && !*past && v->subtree_gap >= len) {
+		/* Everything on the left lies below v->start */
+		if (v->start > lo) {
+			addr = search(v->left, lo, hi, len, align, past);
+			if (addr != 0 || *past)
+				return addr;
+		}
+		if (v->start - v->gap >= hi) {
+			*past = true;
+			return 0;
+		}
+		if (v->gap >= len) {
+			addr = fit(v->start - v->gap, v->start, lo, hi, len, align);
+			if (addr != 0)
+				return addr;
+		}
+		v = v->right;
+	}
+	return 0;
+}
+
+uint64_t vma_find_gap(const struct vma_tree *t, uint64_t lo, uint64_t hi,
+		      uint64_t len, uint64_t align)
+{
+	struct vma *last = t->root;
+	bool past = false;
+	uint64_t addr;
+
+	if (len == 0 || lo >= hi)
+		return 0;
+	addr = search(t->root, lo, hi, len, align, &past);
+	if (addr != 0 || past)
+		return addr;
+
+	/* The gap above the last area */
+	while (last != NULL && last->right != NULL)
+		last = last->right;
+	return fit(last != NULL ? last->end : 0, hi, lo, hi, len, align);
+}
+
+/* The black height of the subtree, -1 if it is broken */
+static int check(const struct vma *v, const struct vma *parent, uint64_t *prev_end,
+		 size_t *count)
+{
+	int left, right;
+	uint64_t gap;
+
+	if (v == NULL)
+		return 1;
+	if (v->parent != parent || (v->red && is_red(parent)))
+		return -1;
+	left = check(v->left, v, prev_end, count);
+	if (left < 0 || v->start >= v->end || v->start < *prev_end ||
+	    v->gap != v->start - *prev_end)
+		return -1;
+	*prev_end = v->end;
+	(*count)++;
+	right = check(v->right, v, prev_end, count);
+	if (right != left)
+		return -1;
+
+	gap = v->gap;
+	if (v->left != NULL && v->left->subtree_gap > gap)
+		gap = v->left->subtree_gap;
+	if (v->right != NULL && v->right->subtree_gap > gap)
+		gap = v->right->subtree_gap;
+	if (v->subtree_gap != gap)
+		return -1;
+	return left + (v->red ? 0 : 1);
+}
+
+int vma_check(const struct vma_tree *t)
+{
+	uint64_t prev_end = 0;
+	size_t count = 0;
+
+	if (is_red(t->root) || check(t->root, NULL, &prev_end, &count) < 0 || count != t->count)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <types.h>
+#include <syscall.h>
+#include <syscall_nr.h>
+
+/* Must match kernel/include/mman.h */
+#define PROT_NONE	0x0
+#define PROT_READ	0x1
+#define PROT_WRITE	0x2
+#define PROT_EXEC	0x4
+
+#define MAP_PRIVATE	0x02
+#define MAP_FIXED	0x10
+#define MAP_ANONYMOUS	0x20
+#define MAP_POPULATE	0x8000	/* allocate (large pages if possible) up front */
+
+#define MAP_FAILED	((void *) -1)
+
+/* Anonymous mappings only: 'fd' must be -1 and there is no offset */
+static __inline void *mmap(void *addr, size_t len, int prot, int flags, int fd)
+{
+	return (void *) __syscall5(SYS_MMAP, (long) addr, (long) len, prot, flags, fd);
+}
+
+static __inline int munmap(void *addr, size_t len)
+{
+	return (int) __syscall2(SYS_MUNMAP, (long) addr, (long) len);
+}
+
+static __inline int mprotect(void *addr, size_t len, int prot)
+{
+	return (int) __syscall3(SYS_MPROTECT, (long) addr, (long) len, prot);
+}
+
+/* Returns the new end of the heap, the old one on failure; brk(0) queries */
+static __inline void *brk(void *addr)
+{
+	return (void *) __syscall1(SYS_BRK, (long) addr);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <types.h>
+#include <syscall.h>
+#include <syscall_nr.h>
+
+/*
+ * Batched system calls through rings shared with the kernel, must match
+ * kernel/include/ring.h: queue calls with ring_queue(), run them all with
+ * one ring_enter() (or, with RING_POLL, on the next system call of any
+ * kind), then collect the results with ring_complete().
+ */
+#define RING_ENTRIES_MAX	4096
+#define RING_POLL		0x1
+
+struct ring_header {
+	uint32_t sq_head;
+	uint32_t sq_tail;
+	uint32_t cq_head;
+	uint32_t cq_tail;
+	uint32_t sq_entries;
+	uint32_t cq_entries;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+struct ring_sqe {
+	uint64_t nr;
+	uint64_t args[5];
+	uint64_t user_data;
+	uint64_t reserved;
+};
+
+struct ring_cqe {
+	uint64_t user_data;
+	int64_t result;
+};
+
+#define RING_SQES_OFFSET	4096
+#define RING_CQES_OFFSET(sq_entries)	(RING_SQES_OFFSET + (sq_entries) * sizeof(struct ring_sqe))
+
+/* 'entries' is a power of two; the rings (at USER_RING_VA), NULL on failure */
+static __inline struct ring_header *ring_setup(unsigned int entries, int flags)
+{
+	long ret = __syscall2(SYS_RING_SETUP, entries, flags);
+	return ret == -1 ? NULL : (struct ring_header *) ret;
+}
+
+/* The number of calls run */
+static __inline long ring_enter(void)
+{
+	return __syscall0(SYS_RING_ENTER);
+}
+
+/* Queues system call 'nr'; 0, or -1 if the submission ring is full */
+static __inline int ring_queue(struct ring_header *r, long nr, long a1, long a2, long a3,
+			       unsigned long long user_data)
+{
+	struct ring_sqe *sqes = (struct ring_sqe *) ((char *) r + RING_SQES_OFFSET);
+	uint32_t tail = r->sq_tail;
+	struct ring_sqe *sqe;
+
+	if (tail - *(volatile uint32_t *) &r->sq_head >= r->sq_entries)
+		return -1;
+	sqe = &sqes[tail & (r->sq_entries - 1)];
+	sqe->nr = nr;
+	sqe->args[0] = a1;
+	sqe->args[1] = a2;
+	sqe->args[2] = a3;
+	sqe->user_data = user_data;
+	__asm__ __volatile__ ("" : : : "memory");
+	*(volatile uint32_t *) &r->sq_tail = tail + 1;
+	return 0;
+}
+
+/* Takes the oldest completion into '*cqe'; 0, or -1 if there is none */
+static __inline int ring_complete(struct ring_header *r, struct ring_cqe *cqe)
+{
+	struct ring_cqe *cqes = (struct ring_cqe *) ((char *) r + RING_CQES_OFFSET(r->sq_entries));
+	uint32_t head = r->cq_head;
+
+	if (head == *(volatile uint32_t *) &r->cq_tail)
+		return -1;
+	__asm__ __volatile__ ("" : : : "memory");
+	*cqe = cqes[head & (r->cq_entries - 1)];
+	__asm__ __volatile__ ("" : : : "memory");
+	*(volatile uint32_t *) &r->cq_head = head + 1;
+	return 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+/* System call numbers (passed in %rdi), must match kernel/include/syscall_nr.h */
+#define SYS_PRINT		1	/* print(str) */
+#define SYS_FAULT_STATS		2	/* print the page fault statistics */
+#define SYS_FLUSH_TLB		3	/* flush_tlb(global), BENCH builds only */
+#define SYS_MMAP		4	/* mmap(addr, len, prot, flags, fd) */
+#define SYS_MUNMAP		5	/* munmap(addr, len) */
+#define SYS_MPROTECT		6	/* mprotect(addr, len, prot) */
+#define SYS_BRK			7	/* brk(addr) */
+#define SYS_FORK		8	/* fork(), see kernel_asm.S */
+#define SYS_EXIT		9	/* exit(code) */
+#define SYS_WAIT		10	/* wait(pid) */
+#define SYS_SYSCALL_STATS	11	/* print the system call counters, reset them if a1 != 0 */
+#define SYS_RING_SETUP		12	/* ring_setup(entries, flags) */
+#define SYS_RING_ENTER		13	/* ring_enter(), runs the queued calls */
+#define SYS_WRITE		14	/* write(fd, buf, len), fd 1 and 2 are the console */
+#define SYS_NOP			15	/* does nothing, the full path for benchmarks */
+
+/*
+ * Leaf calls: kernel_asm.S answers SYS_FAST_FIRST .. SYS_FAST_LAST on the
+ * user stack, before it saves any register, and returns with SYSRET
+ */
+#define SYS_FAST_FIRST		1024
+#define SYS_KERNEL_STATUS	1024	/* kernel_status */
+#define SYS_CLOCK_NS		1025	/* nanoseconds since the TSC reset, as the data page */
+#define SYS_CPU_ID		1026	/* the APIC ID of the CPU */
+#define SYS_YIELD_HINT		1027	/* spinning: a pause, 0 */
+#define SYS_FAST_LAST		1027
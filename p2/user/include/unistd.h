@@ -0,0 +1,35 @@
+#pragma once
+
+#include <types.h>
+#include <syscall.h>
+#include <syscall_nr.h>
+
+#define STDOUT_FILENO	1
+#define STDERR_FILENO	2
+
+/* 'len' bytes to the console (fd 1 or 2) as they are; len, or -1 */
+static __inline long write(int fd, const void *buf, size_t len)
+{
+	return __syscall3(SYS_WRITE, fd, (long) buf, (long) len);
+}
+
+/*
+ * A copy of the calling process that shares its pages copy-on-write:
+ * the child's pid in the parent, 0 in the child, -1 on failure
+ */
+static __inline int fork(void)
+{
+	return (int) __syscall0(SYS_FORK);
+}
+
+static __inline void exit(int code)
+{
+	__syscall1(SYS_EXIT, code);
+	while (1) {};
+}
+
+/* Waits for a child (pid -1: any) to exit; its code & 0xFF, -1 if no such child */
+static __inline int wait(int pid)
+{
+	return (int) __syscall1(SYS_WAIT, pid);
+}
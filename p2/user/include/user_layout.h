@@ -0,0 +1,28 @@
+#pragma once
+
+/* The user address space, must match kernel/include/user_layout.h */
+
+#define USER_PROGRAM_VA		0xFFFFFFFFFFFFF000ULL
+
+/* Stack and heap pages are allocated and zeroed on first touch */
+#define USER_STACK_TOP		USER_PROGRAM_VA
+#define USER_STACK_SIZE		(1ULL << 20)
+
+/* The program image: text and read-only data, then no-execute data */
+#define USER_IMAGE_VA		0xFFFFFFFFE0000000ULL
+#define USER_IMAGE_MAX		(256ULL << 20)
+
+/* ring_setup() maps the rings here */
+#define USER_RING_VA		0xFFFFFFFFF0000000ULL
+#define USER_RING_MAX		(1ULL << 20)
+
+/* The kernel's read-only data page, see vdso.h */
+#define USER_VDSO_VA		(USER_RING_VA + USER_RING_MAX)
+
+/* brk() moves the end of the heap */
+#define USER_HEAP_VA		0xFFFFFFFFC0000000ULL
+#define USER_HEAP_MAX		(512ULL << 20)
+
+/* mmap() without MAP_FIXED picks addresses in here */
+#define USER_MMAP_BASE		0xFFFFFF8000000000ULL
+#define USER_MMAP_END		USER_HEAP_VA
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <types.h>
+#include <user_layout.h>
+
+/*
+ * The kernel data page at USER_VDSO_VA, read without entering the kernel;
+ * must match kernel/include/vdso.h. The kernel updates it under a
+ * seqlock: a read is only valid if 'seq' was even and did not change.
+ */
+#define VDSO_VERSION	1
+
+struct vdso_data {
+	uint32_t seq;
+	uint32_t version;
+	int64_t status;
+	uint32_t cpu;
+	uint32_t node;
+	uint64_t tsc_khz;
+	uint64_t ns_mult;
+	uint32_t ns_shift;
+	uint32_t reserved;
+	uint64_t clock_tsc;
+	uint64_t clock_ns;
+};
+
+#define VDSO_DATA	((const volatile struct vdso_data *) USER_VDSO_VA)
+
+static __inline uint32_t vdso_read_begin(void)
+{
+	uint32_t seq;
+
+	while ((seq = VDSO_DATA->seq) & 1)
+		;
+	__asm__ __volatile__ ("" : : : "memory");
+	return seq;
+}
+
+static __inline bool vdso_read_retry(uint32_t seq)
+{
+	__asm__ __volatile__ ("" : : : "memory");
+	return VDSO_DATA->seq != seq;
+}
+
+/* What SYS_KERNEL_STATUS returns */
+static __inline long vdso_status(void)
+{
+	uint32_t seq;
+	long status;
+
+	do {
+		seq = vdso_read_begin();
+		status = VDSO_DATA->status;
+	} while (vdso_read_retry(seq));
+	return status;
+}
+
+/* The APIC ID of the CPU that runs this process */
+static __inline unsigned int vdso_cpu(void)
+{
+	uint32_t seq;
+	unsigned int cpu;
+
+	do {
+		seq = vdso_read_begin();
+		cpu = VDSO_DATA->cpu;
+	} while (vdso_read_retry(seq));
+	return cpu;
+}
+
+/* Nanoseconds since the TSC reset, 0 if the kernel does not know the TSC rate */
+static __inline unsigned long long vdso_clock_ns(void)
+{
+	unsigned long long tsc, ns;
+	unsigned int low, high;
+	uint32_t seq;
+
+	do {
+		seq = vdso_read_begin();
+		__asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+		tsc = ((unsigned long long) high << 32) | low;
+		ns = VDSO_DATA->clock_ns + (unsigned long long)
+			(((unsigned __int128) (tsc - VDSO_DATA->clock_tsc) * VDSO_DATA->ns_mult) >>
+			 VDSO_DATA->ns_shift);
+	} while (vdso_read_retry(seq));
+	return ns;
+}
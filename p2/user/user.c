@@ -6,9 +6,222 @@
  */
 
 #include <syscall.h>
+#include <user_layout.h>
+#include <mman.h>
+#include <unistd.h>
+#include <ring.h>
+#include <vdso.h>
 
 static int check_var = 0;
 
+#define RING_ENTRIES	256
+
+#ifdef BENCH
+#define BENCH_ROUNDS	1000
+
+static inline unsigned long long rdtsc(void)
+{
+	unsigned int low, high;
+	__asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+	return ((unsigned long long) high << 32) | low;
+}
+
+static char *append(char *p, const char *s)
+{
+	while (*s != '\0')
+		*p++ = *s++;
+	*p = '\0';
+	return p;
+}
+
+static char *append_num(char *p, unsigned long long v)
+{
+	char buf[20], *q = buf + sizeof(buf);
+	*--q = '\0';
+	do {
+		*--q = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	return append(p, q);
+}
+
+/*
+ * Cycles per round trip of system call 'nr', each after a TLB flush
+ * (flush = 1: non-global entries, 2: everything) if 'flush'
+ */
+static unsigned long long syscall_cycles(long nr, long flush)
+{
+	unsigned long long start, total = 0;
+	int i;
+
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		if (flush)
+			__syscall1(SYS_FLUSH_TLB, flush - 1);
+		start = rdtsc();
+		__syscall0(nr);
+		total += rdtsc() - start;
+	}
+	return total / BENCH_ROUNDS;
+}
+
+#define CONSOLE_BENCH_BYTES	(64 << 10)
+
+static char console_text[CONSOLE_BENCH_BYTES + 1];
+
+/* MB/s for 'bytes' in 'cycles' at the TSC rate of the kernel data page */
+static unsigned long long mb_per_s(unsigned long long bytes, unsigned long long cycles)
+{
+	return cycles ? bytes * VDSO_DATA->tsc_khz / cycles / 1000 : 0;
+}
+
+/* Console output: print (printf("%s\n")) vs. write() of the same text */
+static void bench_console(void)
+{
+	unsigned long long start, printed, written;
+	char msg[160], *p = msg;
+	int i;
+
+	/* 64-character lines */
+	for (i = 0; i < CONSOLE_BENCH_BYTES; i++)
+		console_text[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+	console_text[CONSOLE_BENCH_BYTES - 1] = '\0';
+
+	start = rdtsc();
+	__syscall1(SYS_PRINT, (long) console_text);
+	printed = rdtsc() - start;
+
+	console_text[CONSOLE_BENCH_BYTES - 1] = '\n';
+	start = rdtsc();
+	write(STDOUT_FILENO, console_text, CONSOLE_BENCH_BYTES);
+	written = rdtsc() - start;
+
+	if (VDSO_DATA->tsc_khz == 0) {
+		p = append(p, "Console, 64 KiB: ");
+		p = append_num(p, printed);
+		p = append(p, " cycles via print, ");
+		p = append_num(p, written);
+		append(p, " via write");
+	} else {
+		p = append(p, "Console: ");
+		p = append_num(p, mb_per_s(CONSOLE_BENCH_BYTES, printed));
+		p = append(p, " MB/s via print, ");
+		p = append_num(p, mb_per_s(CONSOLE_BENCH_BYTES, written));
+		append(p, " MB/s via write");
+	}
+	__syscall1(SYS_PRINT, (long) msg);
+}
+
+/* Cycles to read the status from the kernel data page instead */
+static unsigned long long vdso_cycles(void)
+{
+	unsigned long long start, total = 0;
+	int i;
+
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		start = rdtsc();
+		vdso_status();
+		total += rdtsc() - start;
+	}
+	return total / BENCH_ROUNDS;
+}
+
+static void bench_syscall(void)
+{
+	char msg[160], *p = msg;
+
+	p = append(p, "Syscall round trip: ");
+	p = append_num(p, syscall_cycles(SYS_NOP, 0));
+	p = append(p, " cycles warm, ");
+	p = append_num(p, syscall_cycles(SYS_NOP, 1));
+	p = append(p, " after a CR3 write, ");
+	p = append_num(p, syscall_cycles(SYS_NOP, 2));
+	append(p, " after a global flush");
+	__syscall1(1, (long) msg);
+
+	/* The same null call with and without the register save and C dispatch */
+	p = append(msg, "Null syscall: ");
+	p = append_num(p, syscall_cycles(SYS_YIELD_HINT, 0));
+	p = append(p, " cycles on the leaf path, ");
+	p = append_num(p, syscall_cycles(SYS_NOP, 0));
+	append(p, " on the full path");
+	__syscall1(SYS_PRINT, (long) msg);
+
+	p = append(msg, "Kernel status from the data page: ");
+	p = append_num(p, vdso_cycles());
+	append(p, " cycles");
+	__syscall1(SYS_PRINT, (long) msg);
+}
+
+#define RING_BENCH_OPS	4096
+
+/*
+ * Cycles per null call (kernel_status): one syscall each vs. batches
+ * through the rings that test_ring() has set up
+ */
+static void bench_ring(void)
+{
+	struct ring_header *r = (struct ring_header *) USER_RING_VA;
+	unsigned long long start, direct, batched;
+	char msg[160], *p = msg;
+	struct ring_cqe cqe;
+	int i, j;
+
+	if (ring_enter() < 0)
+		return;
+
+	start = rdtsc();
+	for (i = 0; i < RING_BENCH_OPS; i++)
+		__syscall0(SYS_KERNEL_STATUS);
+	direct = (rdtsc() - start) / RING_BENCH_OPS;
+
+	start = rdtsc();
+	for (i = 0; i < RING_BENCH_OPS; i += RING_ENTRIES) {
+		for (j = 0; j < RING_ENTRIES; j++)
+			ring_queue(r, SYS_KERNEL_STATUS, 0, 0, 0, j);
+		ring_enter();
+		while (ring_complete(r, &cqe) == 0)
+			;
+	}
+	batched = (rdtsc() - start) / RING_BENCH_OPS;
+
+	p = append(p, "Null calls: ");
+	p = append_num(p, direct);
+	p = append(p, " cycles each as syscalls, ");
+	p = append_num(p, batched);
+	p = append(p, " through the rings (");
+	p = append_num(p, RING_ENTRIES);
+	append(p, " per ring_enter)");
+	__syscall1(SYS_PRINT, (long) msg);
+}
+#endif
+
+/* A batch of calls through the rings, with one that cannot be queued */
+static void test_ring(void)
+{
+	struct ring_header *r = ring_setup(RING_ENTRIES, 0);
+	struct ring_cqe cqe;
+	long heap = (long) brk(0), status = __syscall0(SYS_KERNEL_STATUS), ok = 1, n = 0;
+	int i;
+
+	if (r == NULL) {
+		__syscall1(SYS_PRINT, (long) "rings: FAILED");
+		return;
+	}
+	for (i = 0; i < 8; i++)
+		ring_queue(r, SYS_BRK, 0, 0, 0, i);
+	ring_queue(r, SYS_KERNEL_STATUS, 0, 0, 0, 8);
+	ring_queue(r, SYS_FORK, 0, 0, 0, 9);
+	if (ring_enter() != 10)
+		ok = 0;
+	while (ring_complete(r, &cqe) == 0) {
+		if (cqe.user_data != (unsigned long long) n ||
+		    cqe.result != (n < 8 ? heap : n == 8 ? status : -1))
+			ok = 0;
+		n++;
+	}
+	__syscall1(SYS_PRINT, (long) (ok && n == 10 ? "rings: OK" : "rings: FAILED"));
+}
+
 void user_start(void)
 {
 	__syscall1(1, (long) "This message is from user space!\n");
@@ -22,6 +235,78 @@ void user_start(void)
 		__syscall1(1, (long) "SYSCALLS (Q2): YES\nPAGE_TABLES (Q3): NO\nUSER_SPACE (Q4): NO\n\nFinal: 40/130 points\n");
 	}
 
+	/* Touch every 4 KiB of a 1 MiB heap: one page fault each */
+	volatile char *heap = brk(0);
+	unsigned long off;
+	if (brk((void *) (heap + (1UL << 20))) == heap + (1UL << 20)) {
+		for (off = 0; off < (1UL << 20); off += 4096)
+			heap[off] = 1;
+	}
+	__syscall0(SYS_FAULT_STATS);
+
+	/* 4 MiB, prefaulted (2 MiB pages where possible), then read-only and gone */
+	char *buf = mmap(NULL, 4UL << 20, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1);
+	if (buf != MAP_FAILED) {
+		for (off = 0; off < (4UL << 20); off += 4096)
+			buf[off] = (char) off;
+	}
+	if (buf != MAP_FAILED && mprotect(buf, 4UL << 20, PROT_READ) == 0 &&
+	    munmap(buf, 4UL << 20) == 0)
+		__syscall1(SYS_PRINT, (long) "mmap/mprotect/munmap: OK");
+	else
+		__syscall1(SYS_PRINT, (long) "mmap/mprotect/munmap: FAILED");
+
+	/* The child's writes go to copies of the shared pages, not to ours */
+	int pid = fork();
+	if (pid == 0) {
+		heap[0] = 2;
+		exit(heap[0] == 2 ? 42 : 1);
+	}
+	if (pid > 0 && wait(pid) == 42 && heap[0] == 1)
+		__syscall1(SYS_PRINT, (long) "fork/copy-on-write: OK");
+	else
+		__syscall1(SYS_PRINT, (long) "fork/copy-on-write: FAILED");
+
+	test_ring();
+
+	/* Raw bytes, only to the console and only from mapped memory */
+	if (write(STDERR_FILENO, "write: ", 7) == 7 && write(3, "x", 1) == -1 &&
+	    write(STDOUT_FILENO, (void *) USER_MMAP_BASE, 1) == -1)
+		write(STDOUT_FILENO, "OK\n", 3);
+	else
+		write(STDOUT_FILENO, "FAILED\n", 7);
+
+	/* The data page agrees with the system call, its clock only goes forward */
+	unsigned long long t0 = vdso_clock_ns(), t1 = vdso_clock_ns();
+	if (VDSO_DATA->version == VDSO_VERSION && vdso_status() == __syscall0(SYS_KERNEL_STATUS) &&
+	    t1 >= t0)
+		__syscall1(SYS_PRINT, (long) "vDSO data page: OK");
+	else
+		__syscall1(SYS_PRINT, (long) "vDSO data page: FAILED");
+
+	/* Leaf calls answer as the data page does and leave the registers alone */
+	long a1 = 0x1111, a2 = 0x2222;
+	register long a3 __asm__("r10") = 0x3333;
+	long clock;
+	t0 = vdso_clock_ns();
+	__asm__ __volatile__ ("syscall" : "=a"(clock), "+S"(a1), "+d"(a2), "+r"(a3)
+			      : "D"(SYS_CLOCK_NS) : "rcx", "r11", "memory");
+	t1 = vdso_clock_ns();
+	if (__syscall0(SYS_CPU_ID) == vdso_cpu() && __syscall0(SYS_YIELD_HINT) == 0 &&
+	    (unsigned long long) clock >= t0 && (unsigned long long) clock <= t1 &&
+	    a1 == 0x1111 && a2 == 0x2222 && a3 == 0x3333)
+		__syscall1(SYS_PRINT, (long) "leaf syscalls: OK");
+	else
+		__syscall1(SYS_PRINT, (long) "leaf syscalls: FAILED");
+
+#ifdef BENCH
+	bench_syscall();
+	bench_ring();
+	bench_console();
+#endif
+	__syscall1(SYS_SYSCALL_STATS, 0);
+
 	/* Never exit */
 	while (1) {};
 }